@@ -0,0 +1,75 @@
+#include <cmath>
+#include <iomanip>
+
+#include "analysis.hpp"
+#include "trace.hpp"
+
+// the wall particles of the box carry their own rest pressure, so the load is
+// measured on the fluid particles within a kernel support of its surface
+inline bool near_box(const BoundingBox& region, const realvec& pos) {
+  return region.intersect(BoundingBox(pos));
+}
+
+typedef struct {
+  real front;
+  real box_pres_max;
+  real box_pres_sum;
+  int  box_n;
+  real kinetic;
+  real dens_dev;
+} AnalysisPartial;
+
+AnalysisSample analyze(const ParticleTree& ptree, const BoundingBox& box) {
+  TRACE_SCOPE("analysis");
+  const BoundingBox region = BoundingBox(box).expand(SLEN);
+  AnalysisPartial init = {-INFINITY, 0, 0, 0, 0, 0};
+
+  AnalysisPartial r = ptree.reduce_leaf(init, [&] (const ParticleTreeNode* leaf) {
+    AnalysisPartial a = init;
+    if (leaf->n_fluid == 0) return a;
+    const Particle* ps = leaf->particles_i;
+    for (int i = 0; i < leaf->n_fluid; i++) {
+      a.front    = max_(a.front, ps[i].pos.x);
+      a.kinetic += 0.5 * ps[i].mass * (ps[i].vel * ps[i].vel);
+      a.dens_dev = max_(a.dens_dev, real(std::abs(ps[i].dens - DENS0) / DENS0));
+      if (near_box(region, ps[i].pos)) {
+        a.box_pres_max  = max_(a.box_pres_max, ps[i].pres);
+        a.box_pres_sum += ps[i].pres;
+        a.box_n++;
+      }
+    }
+    return a;
+  }, [] (const AnalysisPartial& a, const AnalysisPartial& b) {
+    AnalysisPartial c;
+    c.front        = max_(a.front, b.front);
+    c.box_pres_max = max_(a.box_pres_max, b.box_pres_max);
+    c.box_pres_sum = a.box_pres_sum + b.box_pres_sum;
+    c.box_n        = a.box_n + b.box_n;
+    c.kinetic      = a.kinetic + b.kinetic;
+    c.dens_dev     = max_(a.dens_dev, b.dens_dev);
+    return c;
+  });
+
+  AnalysisSample sample;
+  sample.front         = r.front;
+  sample.box_pres_max  = r.box_pres_max;
+  sample.box_pres_mean = r.box_n ? r.box_pres_sum / r.box_n : 0;
+  sample.kinetic       = r.kinetic;
+  sample.dens_dev      = r.dens_dev;
+  return sample;
+}
+
+AnalysisWriter::AnalysisWriter(const char* filename) : ofs_(filename) {
+  ofs_ << "# time step front box_pres_max box_pres_mean kinetic dens_dev" << std::endl;
+  ofs_ << std::scientific << std::setprecision(8);
+}
+
+void AnalysisWriter::write(const double time, const int step, const AnalysisSample& sample) {
+  ofs_ << time                 << " "
+       << step                 << " "
+       << sample.front         << " "
+       << sample.box_pres_max  << " "
+       << sample.box_pres_mean << " "
+       << sample.kinetic       << " "
+       << sample.dens_dev      << std::endl;
+}
@@ -0,0 +1,32 @@
+#pragma once
+
+#include <fstream>
+
+#include "config.hpp"
+#include "defs.hpp"
+#include "particle_tree.hpp"
+
+/*
+ * In-situ analysis: scalar reductions over the particles, appended as one
+ * line per call to a small time series instead of dumping full snapshots.
+ */
+
+typedef struct {
+  real front;         // largest x of a fluid particle
+  real box_pres_max;  // fluid pressure at the obstacle
+  real box_pres_mean;
+  real kinetic;       // total kinetic energy of the fluid
+  real dens_dev;      // largest |dens - DENS0| / DENS0 of a fluid particle
+} AnalysisSample;
+
+// box is the obstacle (see obstacle() in scenario.hpp)
+AnalysisSample analyze(const ParticleTree& ptree, const BoundingBox& box);
+
+class AnalysisWriter {
+  private:
+    std::ofstream ofs_;
+
+  public:
+    AnalysisWriter(const char* filename);
+    void write(const double time, const int step, const AnalysisSample& sample);
+};
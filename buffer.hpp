@@ -0,0 +1,96 @@
+#pragma once
+
+#include <cstddef>
+#include <new>
+#include <sys/mman.h>
+
+#include "config.hpp"
+#include "numa.hpp"
+
+/*
+ * Storage for the large particle arrays.
+ *
+ * SPH_HUGE_PAGES 0: regular pages
+ *                1: transparent huge pages (madvise)
+ *                2: explicit huge pages (MAP_HUGETLB), falling back to 1
+ *                   if no huge pages are reserved
+ *
+ * Buffers smaller than a huge page use regular pages, as rounding them up
+ * would multiply the memory of small runs.
+ *
+ * Buffers only grow, so that rebuilding the tree does not free and map the
+ * gather buffer again on every step. Memory is not touched here; the caller
+ * places the pages by a parallel first touch whenever reserve() returns true.
+ */
+
+constexpr size_t HUGE_PAGE_SIZE = 2 * 1024 * 1024;
+
+inline void* large_alloc(const size_t len, const bool huge) {
+  void* addr = MAP_FAILED;
+#if SPH_HUGE_PAGES == 2 && defined(MAP_HUGETLB)
+  if (huge) {
+    addr = mmap(NULL, len, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+  }
+#endif
+  if (addr == MAP_FAILED) {
+    addr = mmap(NULL, len, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (addr == MAP_FAILED) throw std::bad_alloc();
+#if SPH_HUGE_PAGES && defined(MADV_HUGEPAGE)
+    if (huge) madvise(addr, len, MADV_HUGEPAGE);
+#endif
+  }
+  numa_apply_policy(addr, len);
+  return addr;
+}
+
+inline void large_free(void* addr, const size_t len) {
+  munmap(addr, len);
+}
+
+template <typename T>
+class LargeBuffer {
+  private:
+    T*     data_;
+    size_t capacity_;
+    size_t len_;
+
+  public:
+    LargeBuffer() : data_(NULL), capacity_(0), len_(0) {}
+    LargeBuffer(const LargeBuffer&) = delete;
+    LargeBuffer& operator = (const LargeBuffer&) = delete;
+    ~LargeBuffer() {
+      if (data_) large_free(data_, len_);
+    }
+
+    // Make room for at least n elements, discarding the contents if the buffer
+    // has to grow. Returns true if new (untouched) memory was mapped.
+    bool reserve(const size_t n, const double growth = 1.0) {
+      if (n <= capacity_) return false;
+      if (data_) large_free(data_, len_);
+      const size_t bytes = (size_t)(n * growth) * sizeof(T);
+      const bool   huge  = SPH_HUGE_PAGES && bytes >= HUGE_PAGE_SIZE;
+      const size_t page  = huge ? HUGE_PAGE_SIZE : sysconf(_SC_PAGESIZE);
+      len_      = ((bytes + page - 1) / page) * page;
+      data_     = static_cast<T*>(large_alloc(len_, huge));
+      capacity_ = len_ / sizeof(T);
+      return true;
+    }
+
+    size_t capacity() const {
+      return capacity_;
+    }
+
+    size_t bytes() const {
+      return len_;
+    }
+
+    T* data() const {
+      return data_;
+    }
+
+    operator T* () const {
+      return data_;
+    }
+};
@@ -12,14 +12,153 @@
 # define SPH_CFL_DT 0
 #endif
 
+#ifndef SPH_BLOCK_DT
+# define SPH_BLOCK_DT 0
+#endif
+
+#ifndef SPH_MAX_RUNG
+# define SPH_MAX_RUNG 3
+#endif
+
+#if SPH_BLOCK_DT && !SPH_CFL_DT
+# error "SPH_BLOCK_DT requires SPH_CFL_DT"
+#endif
+
+// final kick, initial kick and drift in one pass over the particles
+// (block time steps kick particles on their own schedules)
+#ifndef SPH_FUSED_INTEGRATOR
+# define SPH_FUSED_INTEGRATOR (!SPH_BLOCK_DT)
+#endif
+
+#if SPH_FUSED_INTEGRATOR && SPH_BLOCK_DT
+# error "SPH_FUSED_INTEGRATOR cannot be used with SPH_BLOCK_DT"
+#endif
+
+// smoothing kernel (smoothing_kernel.hpp)
+// the Wendland kernels need a support of 2.8 L0 for an accurate density,
+// against 2.1 L0 for the cubic spline, so they have more neighbors, not
+// fewer (20.5 against 12.8 in 2D, 25% more time per step);
+// SPH_KERNEL_SUPPORT trades that accuracy for fewer neighbors
+#define SPH_CUBIC_SPLINE 0
+#define SPH_WENDLAND_C2  1
+#define SPH_WENDLAND_C4  2
+
+#ifndef SPH_SMOOTHING_KERNEL
+# define SPH_SMOOTHING_KERNEL SPH_CUBIC_SPLINE
+#endif
+
+// time step coefficient of DT (0.4 * SLEN / SND / (1 + 0.6 * ALPHA))
+#ifndef SPH_DT_COEF
+# define SPH_DT_COEF 0.4
+#endif
+
+// Shepard filter of the density every SPH_SHEPARD_INTERVAL steps (0: never)
+#ifndef SPH_SHEPARD_INTERVAL
+# define SPH_SHEPARD_INTERVAL 0
+#endif
+
+// delta-SPH diffusion of the density with coefficient SPH_DELTA_COEF
+#ifndef SPH_DELTA_SPH
+# define SPH_DELTA_SPH 0
+#endif
+
+#ifndef SPH_DELTA_COEF
+# define SPH_DELTA_COEF 0.1
+#endif
+
+#define SPH_DENSITY_FILTER (SPH_SHEPARD_INTERVAL || SPH_DELTA_SPH)
+
 #ifndef SPH_REUSE_TREE
 # define SPH_REUSE_TREE 0
 #endif
 
+#ifndef SPH_REBUILD_INTERVAL
+# define SPH_REBUILD_INTERVAL 1
+#endif
+
+#ifndef SPH_REORDER_INTERVAL
+# define SPH_REORDER_INTERVAL 0
+#endif
+
+// 0: particles are written in memory order
+// 1: particles are written in the order of the input file
+// 2: memory order with the input index as an extra column
+#ifndef SPH_OUTPUT_IDS
+# define SPH_OUTPUT_IDS 0
+#endif
+
+// write compressed binary snapshots (snapshot.hpp) instead of text
+#ifndef SPH_OUTPUT_BINARY
+# define SPH_OUTPUT_BINARY 0
+#endif
+
+// bits per quantized coordinate in binary snapshots
+#ifndef SPH_SNAPSHOT_BITS
+# define SPH_SNAPSHOT_BITS 16
+#endif
+
+#if SPH_SNAPSHOT_BITS < 1 || SPH_SNAPSHOT_BITS > 21
+# error "SPH_SNAPSHOT_BITS must be between 1 and 21"
+#endif
+
+#ifndef SPH_TRACK_IDS
+# define SPH_TRACK_IDS (SPH_OUTPUT_IDS != 0)
+#endif
+
+#if SPH_OUTPUT_IDS && !SPH_TRACK_IDS
+# error "SPH_OUTPUT_IDS requires SPH_TRACK_IDS"
+#endif
+
 #ifndef SPH_DATA_SCALE
 # define SPH_DATA_SCALE 1
 #endif
 
+// serve live metrics on 127.0.0.1:SPH_METRICS_PORT (metrics.hpp, 0: off)
+#ifndef SPH_METRICS_PORT
+# define SPH_METRICS_PORT 0
+#endif
+
+// print the progress line of a step at most every SPH_LOG_INTERVAL ms
+// (0: every step)
+#ifndef SPH_LOG_INTERVAL
+# define SPH_LOG_INTERVAL 0
+#endif
+
+// render a frame every SPH_RENDER_INTERVAL steps (render.hpp, 0: never)
+#ifndef SPH_RENDER_INTERVAL
+# define SPH_RENDER_INTERVAL 0
+#endif
+
+// 0: PPM, 1: PNG
+#ifndef SPH_RENDER_FORMAT
+# define SPH_RENDER_FORMAT 1
+#endif
+
+#ifndef SPH_RENDER_WIDTH
+# define SPH_RENDER_WIDTH 1000
+#endif
+
+// particle colors: 0: type, 1: density, 2: speed, 3: CPU of the leaf
+#ifndef SPH_RENDER_COLOR
+# define SPH_RENDER_COLOR 0
+#endif
+
+// draw the outlines of the leaf boxes
+#ifndef SPH_RENDER_LEAVES
+# define SPH_RENDER_LEAVES 0
+#endif
+
+// 0: read the particles from data/data{2,3}d.txt (scripts/gen_data_*.py)
+// 1: generate the same dam break natively (scenario.hpp)
+#ifndef SPH_SCENARIO
+# define SPH_SCENARIO 0
+#endif
+
+// write the generated particles to result/data{2,3}d.txt
+#ifndef SPH_SCENARIO_EXPORT
+# define SPH_SCENARIO_EXPORT 0
+#endif
+
 #ifndef SPH_MAX_STEP
 # define SPH_MAX_STEP 1000
 #endif
@@ -28,22 +167,158 @@
 # define SPH_OUTPUT_INTERVAL 0
 #endif
 
+// write analysis samples every SPH_ANALYSIS_INTERVAL steps (0: never)
+#ifndef SPH_ANALYSIS_INTERVAL
+# define SPH_ANALYSIS_INTERVAL 0
+#endif
+
+// tree and interaction statistics (tree_stats.hpp) every step, with
+// histograms next to each particle_tree dump; the extra pass over all
+// neighbor pairs is included in the step time
+#ifndef SPH_TREE_STATS
+# define SPH_TREE_STATS 0
+#endif
+
+// largest number of particles in a leaf
 #ifndef SPH_PARTICLES_CUTOFF
 # define SPH_PARTICLES_CUTOFF 64
 #endif
 
+// leaf splitting below SPH_PARTICLES_CUTOFF
+// 0: none
+// 1: split while the estimated cost of the children as leaves is lower than
+//    that of the node; a leaf costs its candidate pairs, SPH_GATHER_COST
+//    pairs per gathered particle and SPH_LEAF_COST pairs
+#ifndef SPH_SPLIT_POLICY
+# define SPH_SPLIT_POLICY 0
+#endif
+
+#ifndef SPH_GATHER_COST
+# define SPH_GATHER_COST 16
+#endif
+
+#ifndef SPH_LEAF_COST
+# define SPH_LEAF_COST 256
+#endif
+
+// nodes this small are never split by SPH_SPLIT_POLICY
+#ifndef SPH_LEAF_MIN
+# define SPH_LEAF_MIN 8
+#endif
+
+// split nodes at the center of the bounding box of their particles instead
+// of the center of their square cell
+#ifndef SPH_TIGHT_SPLIT
+# define SPH_TIGHT_SPLIT 0
+#endif
+
+#ifndef SPH_TRAVERSE_TASKS
+# define SPH_TRAVERSE_TASKS 256
+#endif
+
+// elements per chunk of parallel_reduce
+#ifndef SPH_REDUCE_CHUNK
+# define SPH_REDUCE_CHUNK 64
+#endif
+
 #ifndef SPH_RECORD_CPU
 # define SPH_RECORD_CPU 0
 #endif
 
+// record a Chrome trace (trace.hpp) of the phases and per-leaf work,
+// written with each output (result/trace.json.N) or at the end of the run
+#ifndef SPH_TRACE
+# define SPH_TRACE 0
+#endif
+
+// events kept per thread
+#ifndef SPH_TRACE_EVENTS
+# define SPH_TRACE_EVENTS (1 << 18)
+#endif
+
+#ifndef SPH_NUMA_POLICY
+# define SPH_NUMA_POLICY 0
+#endif
+
+#ifndef SPH_NUMA_NODE
+# define SPH_NUMA_NODE 0
+#endif
+
+#ifndef SPH_HUGE_PAGES
+# define SPH_HUGE_PAGES 1
+#endif
+
+#ifndef SPH_PIN_THREADS
+# define SPH_PIN_THREADS 0
+#endif
+
 #ifndef SPH_LOOP_PARALLEL
 # define SPH_LOOP_PARALLEL 0
 #endif
 
+// MassiveThreads (mtbb) as the host parallel backend
+#ifndef SPH_TASK_PARALLEL
+# define SPH_TASK_PARALLEL 0
+#endif
+
+// built-in work-stealing runtime (task.hpp) as the host parallel backend
+#ifndef SPH_TASK_RUNTIME
+# define SPH_TASK_RUNTIME 0
+#endif
+
+#if SPH_LOOP_PARALLEL + SPH_TASK_PARALLEL + SPH_TASK_RUNTIME > 1
+# error "SPH_LOOP_PARALLEL, SPH_TASK_PARALLEL and SPH_TASK_RUNTIME are exclusive"
+#endif
+
+#define SPH_HOST_PARALLEL (SPH_LOOP_PARALLEL || SPH_TASK_PARALLEL || SPH_TASK_RUNTIME)
+
+// iterations per task of parallel_for (0: about 8 tasks per worker)
+#ifndef SPH_PFOR_GRAIN
+# define SPH_PFOR_GRAIN 0
+#endif
+
+// subtrees with fewer particles are traversed without spawning tasks
+#ifndef SPH_TASK_CUTOFF
+# define SPH_TASK_CUTOFF 1024
+#endif
+
 #ifndef SPH_CUDA_PARALLEL
 # define SPH_CUDA_PARALLEL 0
 #endif
 
+// run the per-leaf passes of a step as a dataflow task graph
+// (ParticleTree::calc_dataflow) instead of one global phase per pass
+#ifndef SPH_DATAFLOW
+# define SPH_DATAFLOW 0
+#endif
+
+// the tasks of the graph spawn into one shared TaskGroup, which
+// mtbb::task_group does not allow
+#if SPH_DATAFLOW && (SPH_LOOP_PARALLEL || SPH_TASK_PARALLEL || SPH_CUDA_PARALLEL)
+# error "SPH_DATAFLOW needs SPH_TASK_RUNTIME (or a serial build)"
+#endif
+
+// runs of an ensemble (sph.out <file>) in flight at once with
+// SPH_TASK_RUNTIME (0: one per worker)
+#ifndef SPH_ENSEMBLE_WIDTH
+# define SPH_ENSEMBLE_WIDTH 0
+#endif
+
+// upper bound of the gather buffer of calc() in MiB (0: unbounded); leaves
+// are then processed in batches whose neighbor copies fit into the budget
+#ifndef SPH_GATHER_BUDGET
+# define SPH_GATHER_BUDGET 0
+#endif
+
+#if SPH_GATHER_BUDGET && SPH_DATAFLOW
+# error "SPH_GATHER_BUDGET cannot be combined with SPH_DATAFLOW"
+#endif
+
+// with a fixed step the fused kick-drift is known before the forces and
+// joins the graph (not with SPH_TREE_STATS, which needs the positions the
+// interactions were computed with)
+#define SPH_DATAFLOW_KICK (SPH_DATAFLOW && SPH_FUSED_INTEGRATOR && !SPH_CFL_DT && !SPH_TREE_STATS)
+
 #if SPH_CUDA_PARALLEL
 # define SPH_KERNEL __host__ __device__
 #else
@@ -3,6 +3,7 @@
 #include "config.hpp"
 #include "vector2.hpp"
 #include "bounding_box2.hpp"
+#include "smoothing_kernel.hpp"
 
 #if SPH_DOUBLE
 typedef double real;
@@ -35,9 +36,16 @@ typedef struct {
   realvec       acc;
   real          dens;
   real          pres;
+#if SPH_DENSITY_FILTER
+  real          dens_filt;
+#endif
   realvec       vel_half;
 #if SPH_CFL_DT
   real          f;
+#endif
+#if SPH_BLOCK_DT
+  int           rung;
+  bool          active;
 #endif
   particle_type type;
 } Particle;
@@ -47,12 +55,20 @@ typedef void (* calc_kernel_t)(Particle* const, const int, const Particle* const
 typedef enum {
   CALC_TYPE_DENS,
   CALC_TYPE_HYDRO,
+#if SPH_DENSITY_FILTER
+  CALC_TYPE_SHEPARD,
+  CALC_TYPE_DIFFUSION,
+#endif
 } calc_type;
 
 /* Parameters */
 constexpr real END_TIME = 1.5;
 constexpr real L0       = 0.55 / 30 / SPH_DATA_SCALE;
-constexpr real SLEN     = L0 * 2.1;
+#ifdef SPH_KERNEL_SUPPORT
+constexpr real SLEN     = L0 * SPH_KERNEL_SUPPORT;
+#else
+constexpr real SLEN     = L0 * SmoothingKernel::SUPPORT;
+#endif
 #if SPH_REUSE_TREE
 constexpr real SKIN     = SLEN * 0.3;
 #else
@@ -62,6 +78,21 @@ constexpr real DENS0    = 1000.0;
 constexpr real SND      = 31.3;
 constexpr real C_B      = DENS0 * SND * SND / 7;
 constexpr real ALPHA    = 0.1;
-constexpr real VISC     = ALPHA * SLEN * SND / DENS0;
-constexpr real DT       = 0.4 * SLEN / SND / (1 + 0.6 * ALPHA);
+
+// artificial viscosity and largest time step for a given alpha (the runs of
+// an ensemble each have their own, see sph.cpp)
+constexpr real artificial_visc(const real alpha) {
+  return alpha * SLEN * SND / DENS0;
+}
+constexpr real max_time_step(const real alpha) {
+  return SPH_DT_COEF * SLEN / SND / (1 + 0.6 * alpha);
+}
+
+constexpr real VISC     = artificial_visc(ALPHA);
+constexpr real DT       = max_time_step(ALPHA);
 /* constexpr real DT       = 0.0005; */
+#if SPH_BLOCK_DT
+// DT (or max_time_step of a run's viscosity) is the step of the coarsest
+// rung; rung r steps with DT / 2^r
+constexpr int  N_TICKS  = 1 << SPH_MAX_RUNG;
+#endif
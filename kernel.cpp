@@ -1,73 +1,105 @@
 #include "kernel.hpp"
 
 #if SPH_CUDA_PARALLEL
-__device__ calc_kernel_t calc_dens_kernel  = calc_dens;
-__device__ calc_kernel_t calc_hydro_kernel = calc_hydro;
+__device__ calc_kernel_t calc_dens_kernel  = calc_dens<SmoothingKernel>;
+__device__ calc_kernel_t calc_hydro_kernel = calc_hydro<SmoothingKernel>;
+#if SPH_DENSITY_FILTER
+__device__ calc_kernel_t calc_shepard_kernel   = calc_dens_filter<SmoothingKernel, true>;
+__device__ calc_kernel_t calc_diffusion_kernel = calc_dens_filter<SmoothingKernel, false>;
+#endif
 #endif
 
+template <typename Kernel>
 SPH_KERNEL
 inline real W(const realvec dr, const real dr2) {
-  constexpr real H = SLEN / 2.0;
-#if SPH_2D
-  /* constexpr real COEF = 10.0 / 7.0 / M_PI / pow(H, 2); */
-  constexpr real COEF = 10.0 / 7.0 / M_PI / (H * H);
-#else
-  /* constexpr real COEF = 1.0 / M_PI / pow(H, 3); */
-  constexpr real COEF = 1.0 / M_PI / (H * H * H);
-#endif
-  const real s = sqrt(dr2) / H;
-  real v;
-  if (s < 1.0) {
-    v = 1.0 - 1.5 * pow(s, 2) + 0.75 * pow(s, 3);
-  } else if (s < 2.0) {
-    v = 0.25 * pow(2.0 - s, 3);
-  }
-  return COEF * v;
+  return Kernel::template W<DIM>(dr, dr2, SLEN);
 }
 
+template <typename Kernel>
 SPH_KERNEL
 inline realvec gradW(const realvec dr, const real dr2) {
-  constexpr real H = SLEN / 2.0;
-#if SPH_2D
-  /* constexpr real COEF = 45.0 / 14.0 / M_PI / pow(H, 4); */
-  constexpr real COEF = 45.0 / 14.0 / M_PI / (H * H * H * H);
-#else
-  /* constexpr real COEF = 2.25 / M_PI / pow(H, 5); */
-  constexpr real COEF = 2.25 / M_PI / (H * H * H * H * H);
-#endif
-  const real s = sqrt(dr2) / H;
-  realvec v;
-  if (s < 1.0) {
-    v = (s - 4.0 / 3.0) * dr;
-  } else if (s < 2.0) {
-    v = - pow(2.0 - s, 2) / 3.0 / s * dr;
-  }
-  return COEF * v;
+  return Kernel::template gradW<DIM>(dr, dr2, SLEN);
 }
 
 // calculation of density
+template <typename Kernel>
 SPH_KERNEL
 void calc_dens(Particle* const ps_i, const int ni,
                const Particle* const ps_j, const int nj) {
   constexpr real slen2 = SLEN * SLEN;
   for (int i = 0; i < ni; i++) {
+#if SPH_BLOCK_DT
+    if (!ps_i[i].active) continue;
+#endif
     ps_i[i].dens = 0;
     ps_i[i].pres = 0;
     for (int j = 0; j < nj; j++) {
       const realvec dr  = ps_i[i].pos - ps_j[j].pos;
       const real    dr2 = dr * dr;
       if (dr2 >= slen2) continue;
-      const real W_ij = W(dr, dr2);
+      const real W_ij = W<Kernel>(dr, dr2);
       ps_i[i].dens += ps_j[j].mass * W_ij;
     }
     ps_i[i].pres = calc_pressure(ps_i[i].dens);
   }
 }
 
+#if SPH_DENSITY_FILTER
+// Filtered density, written to dens_filt so that the neighbors still see the
+// summation density. With Shepard the density is renormalized by the kernel
+// sum of the particle volumes; with SPH_DELTA_SPH the diffusion term of
+// delta-SPH (Molteni & Colagrossi) is integrated over the step dt (divided
+// by the particle's rung with SPH_BLOCK_DT).
+template <typename Kernel, bool Shepard>
+SPH_KERNEL
+void calc_dens_filter(Particle* const ps_i, const int ni,
+                      const Particle* const ps_j, const int nj, const real dt) {
+  constexpr real slen2 = SLEN * SLEN;
+  const real coef = SPH_DELTA_COEF * (SLEN / 2.0) * SND * dt;
+  for (int i = 0; i < ni; i++) {
+#if SPH_BLOCK_DT
+    if (!ps_i[i].active) continue;
+    const real coef_i = coef / (1 << ps_i[i].rung);
+#else
+    const real coef_i = coef;
+#endif
+    real dens = 0;
+    real vol  = 0;
+    real diff = 0;
+    for (int j = 0; j < nj; j++) {
+      const realvec dr  = ps_i[i].pos - ps_j[j].pos;
+      const real    dr2 = dr * dr;
+      if (dr2 >= slen2) continue;
+      const real V_j = ps_j[j].mass / ps_j[j].dens;
+      if (Shepard) {
+        const real W_ij = W<Kernel>(dr, dr2);
+        dens += ps_j[j].mass * W_ij;
+        vol  += V_j * W_ij;
+      }
+#if SPH_DELTA_SPH
+      if (dr2 > 0) {
+        const realvec gradW_ij = gradW<Kernel>(dr, dr2);
+        diff -= 2 * (ps_j[j].dens - ps_i[i].dens) * (dr * gradW_ij) / dr2 * V_j;
+      }
+#endif
+    }
+    ps_i[i].dens_filt = (Shepard ? dens / vol : ps_i[i].dens) + coef_i * diff;
+  }
+}
+
+template <typename Kernel, bool Shepard>
+SPH_KERNEL
+void calc_dens_filter(Particle* const ps_i, const int ni,
+                      const Particle* const ps_j, const int nj) {
+  calc_dens_filter<Kernel, Shepard>(ps_i, ni, ps_j, nj, DT);
+}
+#endif
+
 // calculation of hydro force
+template <typename Kernel>
 SPH_KERNEL
 void calc_hydro(Particle* const ps_i, const int ni,
-                const Particle* const ps_j, const int nj) {
+                const Particle* const ps_j, const int nj, const real visc) {
   constexpr real slen2 = SLEN * SLEN;
 #if SPH_2D
   const realvec gravity(0.0, -9.81);
@@ -75,21 +107,23 @@ void calc_hydro(Particle* const ps_i, const int ni,
   const realvec gravity(0.0, 0.0, -9.81);
 #endif
   for (int i = 0; i < ni; i++) {
+#if SPH_BLOCK_DT
+    if (!ps_i[i].active) continue;
+#endif
     ps_i[i].acc = 0;
 #if SPH_CFL_DT
     ps_i[i].f = 0;
 #endif
-    /* if (ps_i[i].type != FLUID) continue; */
     const real tmp_pd_i = ps_i[i].pres / pow(ps_i[i].dens, 2);
     for (int j = 0; j < nj; j++) {
       const realvec dr  = ps_i[i].pos - ps_j[j].pos;
       const real    dr2 = dr * dr;
       if (dr2 >= slen2) continue;
       const real tmp_pd_j = ps_j[j].pres / pow(ps_j[j].dens, 2);
-      const realvec gradW_ij = gradW(dr, dr2);
+      const realvec gradW_ij = gradW<Kernel>(dr, dr2);
       const realvec dv = ps_i[i].vel - ps_j[j].vel;
       const real vr = dv * dr;
-      const real AV = (vr <= 0) ? 0 : - VISC * vr / (dr2 + 0.01 * slen2);
+      const real AV = (vr <= 0) ? 0 : - visc * vr / (dr2 + 0.01 * slen2);
       ps_i[i].acc -= ps_j[j].mass * (tmp_pd_i + tmp_pd_j + AV) * gradW_ij;
     }
     ps_i[i].acc += gravity;
@@ -98,3 +132,20 @@ void calc_hydro(Particle* const ps_i, const int ni,
 #endif
   }
 }
+
+template <typename Kernel>
+SPH_KERNEL
+void calc_hydro(Particle* const ps_i, const int ni,
+                const Particle* const ps_j, const int nj) {
+  calc_hydro<Kernel>(ps_i, ni, ps_j, nj, VISC);
+}
+
+template void calc_dens<SmoothingKernel>(Particle* const, const int, const Particle* const, const int);
+template void calc_hydro<SmoothingKernel>(Particle* const, const int, const Particle* const, const int);
+template void calc_hydro<SmoothingKernel>(Particle* const, const int, const Particle* const, const int, const real);
+#if SPH_DENSITY_FILTER
+template void calc_dens_filter<SmoothingKernel, true>(Particle* const, const int, const Particle* const, const int);
+template void calc_dens_filter<SmoothingKernel, false>(Particle* const, const int, const Particle* const, const int);
+template void calc_dens_filter<SmoothingKernel, true>(Particle* const, const int, const Particle* const, const int, const real);
+template void calc_dens_filter<SmoothingKernel, false>(Particle* const, const int, const Particle* const, const int, const real);
+#endif
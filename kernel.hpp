@@ -5,22 +5,77 @@
 #include "config.hpp"
 #include "defs.hpp"
 
+template <typename Kernel>
 SPH_KERNEL
 void calc_dens(Particle* const ps_i, const int ni,
                const Particle* const ps_j, const int nj);
 
+template <typename Kernel>
 SPH_KERNEL
 void calc_hydro(Particle* const ps_i, const int ni,
                 const Particle* const ps_j, const int nj);
 
+// with the artificial viscosity visc instead of VISC
+template <typename Kernel>
+SPH_KERNEL
+void calc_hydro(Particle* const ps_i, const int ni,
+                const Particle* const ps_j, const int nj, const real visc);
+
+#if SPH_DENSITY_FILTER
+template <typename Kernel, bool Shepard>
+SPH_KERNEL
+void calc_dens_filter(Particle* const ps_i, const int ni,
+                      const Particle* const ps_j, const int nj);
+
+// with the diffusion integrated over dt instead of DT
+template <typename Kernel, bool Shepard>
+SPH_KERNEL
+void calc_dens_filter(Particle* const ps_i, const int ni,
+                      const Particle* const ps_j, const int nj, const real dt);
+#endif
+
 SPH_KERNEL
 inline real calc_pressure(const real dens) {
   return max_(0.0, C_B * (pow(dens / DENS0, 7) - 1));
 }
 
+// hydro kernel of a run with its own viscosity, for ParticleTree::calc
+typedef struct {
+  real visc;
+
+  SPH_KERNEL
+  void operator () (Particle* const ps_i, const int ni,
+                    const Particle* const ps_j, const int nj) const {
+    calc_hydro<SmoothingKernel>(ps_i, ni, ps_j, nj, visc);
+  }
+} HydroKernel;
+
+#if SPH_DENSITY_FILTER
+// density filter of a step of the run (of rung 0 with SPH_BLOCK_DT), for
+// ParticleTree::calc
+typedef struct {
+  real dt;
+  bool shepard;
+
+  SPH_KERNEL
+  void operator () (Particle* const ps_i, const int ni,
+                    const Particle* const ps_j, const int nj) const {
+    if (shepard) {
+      calc_dens_filter<SmoothingKernel, true>(ps_i, ni, ps_j, nj, dt);
+    } else {
+      calc_dens_filter<SmoothingKernel, false>(ps_i, ni, ps_j, nj, dt);
+    }
+  }
+} DensFilterKernel;
+#endif
+
 #if SPH_CUDA_PARALLEL
 extern __device__ calc_kernel_t calc_dens_kernel;
 extern __device__ calc_kernel_t calc_hydro_kernel;
+#if SPH_DENSITY_FILTER
+extern __device__ calc_kernel_t calc_shepard_kernel;
+extern __device__ calc_kernel_t calc_diffusion_kernel;
+#endif
 
 inline calc_kernel_t get_calc_kernel(calc_type type) {
   calc_kernel_t h_func;
@@ -31,6 +86,14 @@ inline calc_kernel_t get_calc_kernel(calc_type type) {
     case CALC_TYPE_HYDRO:
       cudaMemcpyFromSymbol(&h_func, calc_hydro_kernel, sizeof(calc_kernel_t));
       break;
+#if SPH_DENSITY_FILTER
+    case CALC_TYPE_SHEPARD:
+      cudaMemcpyFromSymbol(&h_func, calc_shepard_kernel, sizeof(calc_kernel_t));
+      break;
+    case CALC_TYPE_DIFFUSION:
+      cudaMemcpyFromSymbol(&h_func, calc_diffusion_kernel, sizeof(calc_kernel_t));
+      break;
+#endif
   }
   return h_func;
 }
@@ -39,11 +102,19 @@ inline calc_kernel_t get_calc_kernel(calc_type type) {
   calc_kernel_t h_func;
   switch (type) {
     case CALC_TYPE_DENS:
-      h_func = calc_dens;
+      h_func = calc_dens<SmoothingKernel>;
       break;
     case CALC_TYPE_HYDRO:
-      h_func = calc_hydro;
+      h_func = calc_hydro<SmoothingKernel>;
+      break;
+#if SPH_DENSITY_FILTER
+    case CALC_TYPE_SHEPARD:
+      h_func = calc_dens_filter<SmoothingKernel, true>;
       break;
+    case CALC_TYPE_DIFFUSION:
+      h_func = calc_dens_filter<SmoothingKernel, false>;
+      break;
+#endif
   }
   return h_func;
 }
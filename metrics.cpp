@@ -0,0 +1,226 @@
+#include "config.hpp"
+
+#if SPH_METRICS_PORT
+
+#include <cstdio>
+#include <functional>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "metrics.hpp"
+#include "util.hpp"
+
+static const char* PHASE_NAMES[N_PHASES] = {"drift", "tree", "calc", "kick", "output"};
+
+// weight of the last step in the moving averages
+constexpr double RATE_SMOOTHING = 0.1;
+
+// resident set size from /proc, 0 if unavailable
+static size_t current_rss_bytes() {
+  FILE* fp = fopen("/proc/self/statm", "r");
+  if (!fp) return 0;
+  long pages = 0, resident = 0;
+  if (fscanf(fp, "%ld %ld", &pages, &resident) != 2) resident = 0;
+  fclose(fp);
+  return (size_t)resident * sysconf(_SC_PAGESIZE);
+}
+
+class MetricsServer {
+  private:
+    std::mutex               mutex_;    // guards runs_ (not the counters)
+    std::vector<RunMetrics*> runs_;
+    std::thread              thread_;
+    std::atomic<bool>        stop_;
+    int                      fd_;
+    uint64_t                 start_;
+
+    MetricsServer();
+    ~MetricsServer();
+
+    void        serve();
+    std::string render();
+
+  public:
+    static MetricsServer& instance() {
+      static MetricsServer server;
+      return server;
+    }
+
+    void add(RunMetrics* m) {
+      std::lock_guard<std::mutex> lock(mutex_);
+      runs_.push_back(m);
+    }
+
+    void remove(RunMetrics* m) {
+      std::lock_guard<std::mutex> lock(mutex_);
+      for (size_t i = 0; i < runs_.size(); i++) {
+        if (runs_[i] == m) {
+          runs_.erase(runs_.begin() + i);
+          break;
+        }
+      }
+    }
+};
+
+MetricsServer::MetricsServer() : stop_(false), fd_(-1), start_(gettime_in_nsec()) {
+  fd_ = socket(AF_INET, SOCK_STREAM, 0);
+  if (fd_ < 0) {
+    perror("metrics: socket");
+    return;
+  }
+  const int one = 1;
+  setsockopt(fd_, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+  struct sockaddr_in addr = {};
+  addr.sin_family      = AF_INET;
+  addr.sin_port        = htons(SPH_METRICS_PORT);
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if (bind(fd_, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(fd_, 8) < 0) {
+    perror("metrics: bind");
+    close(fd_);
+    fd_ = -1;
+    return;
+  }
+  thread_ = std::thread([this] { serve(); });
+}
+
+MetricsServer::~MetricsServer() {
+  stop_.store(true);
+  if (thread_.joinable()) thread_.join();
+  if (fd_ >= 0) close(fd_);
+}
+
+// one request per connection; whatever is asked for, the answer is the metrics
+void MetricsServer::serve() {
+  struct pollfd pfd = {fd_, POLLIN, 0};
+  while (!stop_.load()) {
+    if (poll(&pfd, 1, 200) <= 0) continue;
+    const int conn = accept(fd_, NULL, NULL);
+    if (conn < 0) continue;
+    struct pollfd cfd = {conn, POLLIN, 0};
+    char req[1024];
+    if (poll(&cfd, 1, 1000) > 0) {
+      if (read(conn, req, sizeof(req)) < 0) {
+        close(conn);
+        continue;
+      }
+    }
+    const std::string body = render();
+    std::ostringstream resp;
+    resp << "HTTP/1.0 200 OK\r\n"
+         << "Content-Type: text/plain; version=0.0.4\r\n"
+         << "Content-Length: " << body.size() << "\r\n"
+         << "Connection: close\r\n\r\n"
+         << body;
+    const std::string s = resp.str();
+    for (size_t sent = 0; sent < s.size(); ) {
+      const ssize_t n = write(conn, s.data() + sent, s.size() - sent);
+      if (n <= 0) break;
+      sent += n;
+    }
+    close(conn);
+  }
+}
+
+std::string MetricsServer::render() {
+  std::ostringstream out;
+  out.precision(15);
+  auto metric = [&] (const char* name, const char* type, const char* help) {
+    out << "# HELP " << name << " " << help << "\n"
+        << "# TYPE " << name << " " << type << "\n";
+  };
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto each_run = [&] (const char* name, const std::function<double (const RunMetrics&)>& get) {
+    for (const RunMetrics* m : runs_) {
+      out << name << "{run=\"";
+      if (m->id_ < 0) out << "main"; else out << m->id_;
+      out << "\"} " << get(*m) << "\n";
+    }
+  };
+  const std::memory_order r = std::memory_order_relaxed;
+
+  metric("sph_step", "gauge", "Current step.");
+  each_run("sph_step", [&] (const RunMetrics& m) { return m.step_.load(r); });
+  metric("sph_time_seconds", "gauge", "Simulated time.");
+  each_run("sph_time_seconds", [&] (const RunMetrics& m) { return m.time_.load(r); });
+  metric("sph_dt_seconds", "gauge", "Current time step.");
+  each_run("sph_dt_seconds", [&] (const RunMetrics& m) { return m.dt_.load(r); });
+  metric("sph_steps_total", "counter", "Steps done.");
+  each_run("sph_steps_total", [&] (const RunMetrics& m) { return m.steps_.load(r); });
+  metric("sph_steps_per_second", "gauge", "Steps per wall-clock second (moving average).");
+  each_run("sph_steps_per_second", [&] (const RunMetrics& m) { return m.step_rate_.load(r); });
+  metric("sph_interactions_total", "counter", "Candidate pairs of the interaction kernels.");
+  each_run("sph_interactions_total", [&] (const RunMetrics& m) { return m.interactions_.load(r); });
+  metric("sph_interactions_per_second", "gauge", "Candidate pairs per wall-clock second (moving average).");
+  each_run("sph_interactions_per_second", [&] (const RunMetrics& m) { return m.interaction_rate_.load(r); });
+  metric("sph_tree_updates_total", "counter", "Steps that built or refitted the tree.");
+  each_run("sph_tree_updates_total", [&] (const RunMetrics& m) { return m.rebuilds_.load(r); });
+  metric("sph_reuse_ratio", "gauge", "Fraction of steps that reused the tree.");
+  each_run("sph_reuse_ratio", [&] (const RunMetrics& m) {
+    const double steps = m.steps_.load(r);
+    return steps > 0 ? 1 - m.rebuilds_.load(r) / steps : 0.0;
+  });
+  metric("sph_phase_seconds_total", "counter", "Wall-clock time per phase of the steps.");
+  for (int p = 0; p < N_PHASES; p++) {
+    for (const RunMetrics* m : runs_) {
+      out << "sph_phase_seconds_total{run=\"";
+      if (m->id_ < 0) out << "main"; else out << m->id_;
+      out << "\",phase=\"" << PHASE_NAMES[p] << "\"} " << m->phase_ns_[p].load(r) * 1e-9 << "\n";
+    }
+  }
+  metric("sph_particle_bytes", "gauge", "Particle arrays.");
+  each_run("sph_particle_bytes", [&] (const RunMetrics& m) { return m.particle_bytes_.load(r); });
+  metric("sph_gather_bytes", "gauge", "Gather buffer of the interactions.");
+  each_run("sph_gather_bytes", [&] (const RunMetrics& m) { return m.gather_bytes_.load(r); });
+
+  metric("sph_resident_bytes", "gauge", "Resident set size of the process.");
+  out << "sph_resident_bytes " << current_rss_bytes() << "\n";
+  metric("sph_peak_resident_bytes", "gauge", "Peak resident set size of the process.");
+  out << "sph_peak_resident_bytes " << peak_rss_bytes() << "\n";
+  metric("sph_uptime_seconds", "gauge", "Wall-clock time since the first run started.");
+  out << "sph_uptime_seconds " << (gettime_in_nsec() - start_) * 1e-9 << "\n";
+  return out.str();
+}
+
+RunMetrics::RunMetrics(const int id)
+  : id_(id), step_(0), time_(0), dt_(0), steps_(0), rebuilds_(0), interactions_(0),
+    step_rate_(0), interaction_rate_(0), particle_bytes_(0), gather_bytes_(0),
+    avg_step_ns_(0) {
+  for (int p = 0; p < N_PHASES; p++) phase_ns_[p].store(0);
+  MetricsServer::instance().add(this);
+}
+
+RunMetrics::~RunMetrics() {
+  MetricsServer::instance().remove(this);
+}
+
+void RunMetrics::end_step(const int step, const double time, const double dt, const bool rebuilt,
+                          const long interactions, const uint64_t* phase_ns) {
+  const std::memory_order r = std::memory_order_relaxed;
+  uint64_t step_ns = 0;
+  for (int p = 0; p < N_PHASES; p++) {
+    phase_ns_[p].store(phase_ns_[p].load(r) + phase_ns[p], r);
+    step_ns += phase_ns[p];
+  }
+  avg_step_ns_ = avg_step_ns_ == 0 ? step_ns
+               : (1 - RATE_SMOOTHING) * avg_step_ns_ + RATE_SMOOTHING * step_ns;
+  step_.store(step, r);
+  time_.store(time, r);
+  dt_.store(dt, r);
+  steps_.store(steps_.load(r) + 1, r);
+  if (rebuilt) rebuilds_.store(rebuilds_.load(r) + 1, r);
+  interactions_.store(interactions_.load(r) + interactions, r);
+  if (avg_step_ns_ > 0) {
+    step_rate_.store(1e9 / avg_step_ns_, r);
+    interaction_rate_.store(interactions * 1e9 / avg_step_ns_, r);
+  }
+}
+
+#endif
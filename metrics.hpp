@@ -0,0 +1,63 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+#include "config.hpp"
+
+/*
+ * Live metrics (SPH_METRICS_PORT): a background thread serves the counters of
+ * every running simulation over HTTP on 127.0.0.1:SPH_METRICS_PORT in the
+ * Prometheus text format, e.g.
+ *
+ *   curl -s localhost:9100/metrics
+ *
+ * The main loop only stores into atomics (relaxed, one writer per run), so it
+ * never waits for a scrape; the server reads a consistent enough snapshot of
+ * each counter on its own.
+ */
+
+enum {
+  PHASE_DRIFT,   // initial kick and drift
+  PHASE_TREE,    // build or refit, reorder, rung activation
+  PHASE_CALC,    // particle interactions
+  PHASE_KICK,    // final kick and time step (and the next drift if fused)
+  PHASE_OUTPUT,  // analysis, frames and files
+  N_PHASES,
+};
+
+class RunMetrics {
+  private:
+    int                   id_;           // in the ensemble, -1 for a single run
+    std::atomic<int>      step_;
+    std::atomic<double>   time_;         // simulated
+    std::atomic<double>   dt_;
+    std::atomic<uint64_t> steps_;
+    std::atomic<uint64_t> rebuilds_;     // tree updates (steps without reuse)
+    std::atomic<uint64_t> interactions_; // candidate pairs of the kernels
+    std::atomic<uint64_t> phase_ns_[N_PHASES];
+    // moving averages over the last steps
+    std::atomic<double>   step_rate_;
+    std::atomic<double>   interaction_rate_;
+    std::atomic<size_t>   particle_bytes_;
+    std::atomic<size_t>   gather_bytes_;
+    double                avg_step_ns_;  // written by the main loop only
+
+    friend class MetricsServer;
+
+  public:
+    RunMetrics(const int id);
+    ~RunMetrics();
+    RunMetrics(const RunMetrics&) = delete;
+    RunMetrics& operator = (const RunMetrics&) = delete;
+
+    // after every step; phase_ns are the durations of the step's phases
+    void end_step(const int step, const double time, const double dt, const bool rebuilt,
+                  const long interactions, const uint64_t* phase_ns);
+
+    void set_memory(const size_t particle_bytes, const size_t gather_bytes) {
+      particle_bytes_.store(particle_bytes, std::memory_order_relaxed);
+      gather_bytes_.store(gather_bytes, std::memory_order_relaxed);
+    }
+};
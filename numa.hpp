@@ -0,0 +1,121 @@
+#pragma once
+
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+#include <unistd.h>
+#include <sched.h>
+#include <sys/syscall.h>
+
+#include "config.hpp"
+#include "util.hpp"
+
+#if SPH_LOOP_PARALLEL
+#include <omp.h>
+#endif
+
+/*
+ * NUMA placement of the large particle arrays.
+ *
+ * SPH_NUMA_POLICY 0: first touch (pages are placed by the parallel loops
+ *                    that initialize them)
+ *                 1: interleave pages over all nodes
+ *                 2: bind pages to node SPH_NUMA_NODE
+ *
+ * mbind/get_mempolicy are called through syscall() so that libnuma is not
+ * required.
+ */
+
+constexpr int NUMA_MPOL_BIND       = 2;
+constexpr int NUMA_MPOL_INTERLEAVE = 3;
+constexpr int NUMA_MPOL_F_NODE     = 1 << 0;
+constexpr int NUMA_MPOL_F_ADDR     = 1 << 1;
+constexpr int NUMA_MAX_NODES       = 64;
+
+inline int numa_n_nodes() {
+  static int n_nodes = 0;
+  if (n_nodes == 0) {
+    char path[64];
+    while (n_nodes < NUMA_MAX_NODES) {
+      sprintf(path, "/sys/devices/system/node/node%d", n_nodes);
+      if (access(path, F_OK) != 0) break;
+      n_nodes++;
+    }
+    if (n_nodes == 0) n_nodes = 1;
+  }
+  return n_nodes;
+}
+
+inline void numa_apply_policy(void* addr, const size_t len) {
+#if SPH_NUMA_POLICY && defined(SYS_mbind)
+  unsigned long nodemask = 0;
+  int mode;
+#if SPH_NUMA_POLICY == 1
+  mode = NUMA_MPOL_INTERLEAVE;
+  for (int i = 0; i < numa_n_nodes(); i++) nodemask |= 1UL << i;
+#else
+  mode = NUMA_MPOL_BIND;
+  nodemask = 1UL << SPH_NUMA_NODE;
+#endif
+  if (syscall(SYS_mbind, addr, len, mode, &nodemask, NUMA_MAX_NODES + 1, 0) != 0) {
+    perror("mbind");
+  }
+#endif
+}
+
+// node of the CPU the calling thread is running on
+inline int numa_current_node() {
+  unsigned cpu, node;
+  if (syscall(SYS_getcpu, &cpu, &node, NULL) != 0) return -1;
+  return node;
+}
+
+// node the page containing addr is placed on (-1 if not yet touched)
+inline int numa_memory_node(const void* addr) {
+#ifdef SYS_get_mempolicy
+  int node = -1;
+  if (syscall(SYS_get_mempolicy, &node, NULL, 0, addr, NUMA_MPOL_F_NODE | NUMA_MPOL_F_ADDR) != 0) {
+    return -1;
+  }
+  return node;
+#else
+  return -1;
+#endif
+}
+
+template <typename T>
+inline void numa_first_touch(T* addr, const int n) {
+  parallel_for(0, n, [&] (int i) {
+    new (&addr[i]) T();
+  });
+}
+
+// Pin the calling thread to the target-th CPU of the process affinity mask.
+inline void pin_to_cpu(int target) {
+  cpu_set_t mask;
+  if (sched_getaffinity(0, sizeof(mask), &mask) != 0) return;
+  target %= CPU_COUNT(&mask);
+  for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+    if (CPU_ISSET(cpu, &mask) && target-- == 0) {
+      cpu_set_t pin;
+      CPU_ZERO(&pin);
+      CPU_SET(cpu, &pin);
+      sched_setaffinity(0, sizeof(pin), &pin);
+      break;
+    }
+  }
+}
+
+// Pin the i-th worker thread to the i-th CPU of the process affinity mask.
+// MassiveThreads binds its workers by itself (MYTH_BIND_WORKERS), and the
+// workers of the built-in runtime pin themselves when they start.
+inline void pin_threads() {
+#if SPH_LOOP_PARALLEL
+#pragma omp parallel
+  {
+    pin_to_cpu(omp_get_thread_num());
+  }
+#elif SPH_TASK_RUNTIME
+  TaskScheduler::instance();
+#endif
+}
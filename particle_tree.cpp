@@ -1,3 +1,7 @@
+#include <algorithm>
+#include <cstdint>
+#include <utility>
+
 #include "particle_tree.hpp"
 
 inline BoundingBox get_bbox(const Particle *particles, const int n) {
@@ -42,42 +46,130 @@ inline ParticleCounter prefix_sum(const ParticleCounter& a) {
   return b;
 }
 
-void partition(const Particle* ps_from, Particle* ps_to, const int n,
+// ids_from/ids_to are NULL unless particle ids are tracked
+void partition(const Particle* ps_from, Particle* ps_to,
+               const int* ids_from, int* ids_to, const int n,
                ParticleCounter offsets, const BoundingBox bbox) {
   for (int i = 0; i < n; i++) {
     int orthant = ps_from[i].pos.orthant(bbox.center());
+    if (ids_from) ids_to[offsets[orthant]] = ids_from[i];
     ps_to[offsets[orthant]++] = ps_from[i];
   }
 }
 
-ParticleTreeNode* build_tree(Particle *particles1, Particle* particles2,
-                             const int n, const BoundingBox bbox, bool flip) {
+// copy particles of a leaf with fluid particles first and return their count
+int partition_fluid(const Particle* ps_from, Particle* ps_to,
+                    const int* ids_from, int* ids_to, const int n) {
+  int n_fluid = 0;
+  for (int i = 0; i < n; i++) {
+    if (ps_from[i].type == FLUID) n_fluid++;
+  }
+  int f = 0;
+  int w = n_fluid;
+  for (int i = 0; i < n; i++) {
+    int k = (ps_from[i].type == FLUID) ? f++ : w++;
+    if (ids_from) ids_to[k] = ids_from[i];
+    ps_to[k] = ps_from[i];
+  }
+  return n_fluid;
+}
+
+#if SPH_SPLIT_POLICY
+// volume of bbox grown by margin on every side
+inline real grown_volume(const BoundingBox& bbox, const real margin) {
+  const realvec d = bbox.max - bbox.min;
+#if SPH_2D
+  return (d.x + 2 * margin) * (d.y + 2 * margin);
+#else
+  return (d.x + 2 * margin) * (d.y + 2 * margin) * (d.z + 2 * margin);
+#endif
+}
+
+// Cost of a leaf in candidate pairs: its particles times the particles
+// within its halo, plus gathering the halo and a fixed overhead. The density
+// of the leaf itself (each particle occupying a cell of L0) is assumed to
+// continue into the halo.
+inline real leaf_cost(const int n, const BoundingBox& bbox) {
+  const real density = n / grown_volume(bbox, 0.5 * L0);
+  const real halo    = density * grown_volume(bbox, SLEN + SKIN);
+  return (n + SPH_GATHER_COST) * halo + SPH_LEAF_COST;
+}
+
+// whether the orthants of a node around center are cheaper as leaves than
+// the node itself
+bool worth_splitting(const Particle* particles, const int n,
+                     const BoundingBox& bbox, const realvec& center) {
+  int         count[(1 << DIM)] = {0};
+  BoundingBox child[(1 << DIM)];
+  for (int i = 0; i < n; i++) {
+    int orthant = particles[i].pos.orthant(center);
+    count[orthant]++;
+    child[orthant].merge(particles[i].pos);
+  }
+  real cost = 0;
+  for (int i = 0; i < (1 << DIM); i++) {
+    if (count[i] == 0) continue;
+    if (count[i] == n) return false;
+    cost += leaf_cost(count[i], child[i]);
+  }
+  return cost < leaf_cost(n, bbox);
+}
+#endif
+
+ParticleTreeNode* build_tree(NodeArena& arena, Particle *particles1, Particle* particles2,
+                             int* ids1, int* ids2,
+                             const int n, const BoundingBox cell, bool flip) {
+#if SPH_SPLIT_POLICY || SPH_TIGHT_SPLIT
+  const BoundingBox tight = get_bbox(particles1, n);
+#endif
+#if SPH_TIGHT_SPLIT
+  const BoundingBox bbox = tight;
+#else
+  const BoundingBox bbox = cell;
+#endif
+
   // create a node
   ParticleTreeNode* node;
   if (flip) {
-    node = new ParticleTreeNode(particles2, particles1, n, bbox);
+    node = arena.alloc(particles2, particles1, n, bbox);
   } else {
-    node = new ParticleTreeNode(particles1, particles2, n, bbox);
+    node = arena.alloc(particles1, particles2, n, bbox);
   }
 
-  if (n <= SPH_PARTICLES_CUTOFF) {
+  bool leaf = n <= SPH_PARTICLES_CUTOFF;
+#if SPH_SPLIT_POLICY
+  if (leaf && n > SPH_LEAF_MIN) {
+    leaf = !worth_splitting(particles1, n, tight, bbox.center());
+  }
+#endif
+
+  if (leaf) {
     node->is_leaf = true;
-    for (int i = 0; i < n; i++) particles2[i] = particles1[i];
+    node->n_fluid = partition_fluid(particles1, particles2, ids1, ids2, n);
+    if (!flip) {
+      for (int i = 0; i < n; i++) particles1[i] = particles2[i];
+      if (ids1) {
+        for (int i = 0; i < n; i++) ids1[i] = ids2[i];
+      }
+    }
   } else {
     // count particles
     ParticleCounter counter = count_particles(particles1, n, bbox);
     // prefix sum
     ParticleCounter offsets = prefix_sum(counter);
     // partition
-    partition(particles1, particles2, n, offsets, bbox);
+    partition(particles1, particles2, ids1, ids2, n, offsets, bbox);
     // recursive tree build
     for (int i = 0; i < (1 << DIM); i++) {
       if (counter[i] == 0) {
         node->children[i] = NULL;
       } else {
         BoundingBox child_bbox = bbox.orthant(i);
-        node->children[i] = build_tree(&particles2[offsets[i]],
+        node->children[i] = build_tree(arena,
+                                       &particles2[offsets[i]],
                                        &particles1[offsets[i]],
+                                       ids1 ? &ids2[offsets[i]] : NULL,
+                                       ids1 ? &ids1[offsets[i]] : NULL,
                                        counter[i], child_bbox, !flip);
       }
     }
@@ -86,15 +178,65 @@ ParticleTreeNode* build_tree(Particle *particles1, Particle* particles2,
   return node;
 }
 
+inline int* offset_ids(int* ids, const int offset) {
+  return ids ? ids + offset : NULL;
+}
+
+// interleave the bits of coordinates quantized within bbox
+inline uint32_t spread_bits(uint32_t v) {
+#if SPH_2D
+  v &= 0x0000ffff;
+  v = (v | (v << 8)) & 0x00ff00ff;
+  v = (v | (v << 4)) & 0x0f0f0f0f;
+  v = (v | (v << 2)) & 0x33333333;
+  v = (v | (v << 1)) & 0x55555555;
+#else
+  v &= 0x000003ff;
+  v = (v | (v << 16)) & 0x030000ff;
+  v = (v | (v <<  8)) & 0x0300f00f;
+  v = (v | (v <<  4)) & 0x030c30c3;
+  v = (v | (v <<  2)) & 0x09249249;
+#endif
+  return v;
+}
+
+inline uint32_t morton_key(const realvec& pos, const BoundingBox& bbox) {
+  constexpr int BITS = 32 / DIM;
+  constexpr real MAX_COORD = (1u << BITS) - 1;
+  auto quantize = [&] (real x, real lo, real hi) {
+    real t = (hi > lo) ? (x - lo) / (hi - lo) : 0;
+    return (uint32_t)(min_(max_(t, real(0)), real(1)) * MAX_COORD);
+  };
+  uint32_t key = spread_bits(quantize(pos.x, bbox.min.x, bbox.max.x))
+               | spread_bits(quantize(pos.y, bbox.min.y, bbox.max.y)) << 1;
+#if !SPH_2D
+  key |= spread_bits(quantize(pos.z, bbox.min.z, bbox.max.z)) << 2;
+#endif
+  return key;
+}
+
 void refine_bbox(ParticleTreeNode* node) {
   if (node->is_leaf) {
     BoundingBox bbox = get_bbox(node->particles_i, node->n_particles);
     node->inner_bbox = bbox;
     node->outer_bbox = bbox.expand(SLEN + SKIN);
   } else {
+    // subtrees are refined as parallel tasks, then merged in child order
+    TaskGroup tg;
+    for (int i = 0; i < (1 << DIM); i++) {
+      if (ParticleTreeNode* child = node->children[i]) {
+        if (node->n_particles > SPH_TASK_CUTOFF) {
+          tg.run([=] { refine_bbox(child); });
+        } else {
+          refine_bbox(child);
+        }
+      }
+    }
+    tg.wait();
+    node->inner_bbox = BoundingBox();
+    node->outer_bbox = BoundingBox();
     for (int i = 0; i < (1 << DIM); i++) {
       if (ParticleTreeNode* child = node->children[i]) {
-        refine_bbox(child);
         node->inner_bbox.merge(child->inner_bbox);
         node->outer_bbox.merge(child->outer_bbox);
       }
@@ -102,115 +244,471 @@ void refine_bbox(ParticleTreeNode* node) {
   }
 }
 
-void search_neighbors_impl(ParticleTreeNode* node, ParticleTreeNode* target) {
-  if (node->is_leaf) {
-    target->neighbors.push_back(node);
-    target->n_neighbors += node->n_particles;
-  } else {
+// Call f for the sub-pairs of a node pair, splitting the larger node.
+// A node paired with itself yields each unordered pair of its children once.
+template <typename Func>
+inline void split_pair(const ParticleTreeNode* a, const ParticleTreeNode* b, const Func f) {
+  if (a == b) {
     for (int i = 0; i < (1 << DIM); i++) {
-      if (ParticleTreeNode* child = node->children[i]) {
-        if (target->outer_bbox.intersect(child->inner_bbox)) {
-          search_neighbors_impl(child, target);
+      if (const ParticleTreeNode* ci = a->children[i]) {
+        for (int j = i; j < (1 << DIM); j++) {
+          if (const ParticleTreeNode* cj = a->children[j]) {
+            f(ci, cj);
+          }
         }
       }
     }
+  } else if (b->is_leaf || (!a->is_leaf && a->n_particles >= b->n_particles)) {
+    for (int i = 0; i < (1 << DIM); i++) {
+      if (const ParticleTreeNode* ci = a->children[i]) {
+        f(ci, b);
+      }
+    }
+  } else {
+    for (int j = 0; j < (1 << DIM); j++) {
+      if (const ParticleTreeNode* cj = b->children[j]) {
+        f(a, cj);
+      }
+    }
   }
 }
 
-void search_neighbors(ParticleTreeNode* root) {
-  pfor_leaf_impl(root, [&] (ParticleTreeNode* leaf) {
-    leaf->neighbors.clear();
-    leaf->n_neighbors = 0;
-    search_neighbors_impl(root, leaf);
-  });
+// Simultaneous walk of two subtrees that emits each pair of overlapping
+// leaves once. outer_bbox is inner_bbox expanded by the same margin for
+// every leaf, so the overlap test is symmetric.
+template <typename Func>
+void dual_traverse(const ParticleTreeNode* a, const ParticleTreeNode* b, const Func emit) {
+  if (!a->outer_bbox.intersect(b->inner_bbox)) return;
+  if (a->is_leaf && b->is_leaf) {
+    emit(a, b);
+  } else {
+    split_pair(a, b, [&] (const ParticleTreeNode* c1, const ParticleTreeNode* c2) {
+      dual_traverse(c1, c2, emit);
+    });
+  }
 }
 
-void delete_nodes(ParticleTreeNode* node) {
-  if (node->is_leaf) {
-    delete node;
-  } else {
+// copy of a tree whose particles moved from base to base_i (and base_j)
+static ParticleTreeNode* clone_tree(NodeArena& arena, const ParticleTreeNode* node,
+                                    const Particle* base, Particle* base_i, Particle* base_j) {
+  const long offset = node->particles_i - base;
+  ParticleTreeNode* copy = arena.alloc(base_i + offset, base_j ? base_j + offset : NULL,
+                                       node->n_particles, node->bbox);
+  *copy = *node;
+  copy->particles_i = base_i + offset;
+  copy->particles_j = base_j ? base_j + offset : NULL;
+  if (!node->is_leaf) {
     for (int i = 0; i < (1 << DIM); i++) {
-      if (ParticleTreeNode* child = node->children[i]) {
-        delete_nodes(child);
-      }
+      const ParticleTreeNode* child = node->children[i];
+      copy->children[i] = child ? clone_tree(arena, child, base, base_i, base_j) : NULL;
     }
-    delete node;
   }
+  return copy;
 }
 
-ParticleTree::ParticleTree(const std::vector<Particle>& particles) {
-  n_particles_ = particles.size();
-  particles_i_ = new Particle[n_particles_];
-  particles_j_ = new Particle[n_particles_];
-  for (int i = 0; i < n_particles_; i++) {
-    particles_i_[i] = particles[i];
+ParticleTree::ParticleTree(const std::vector<Particle>& particles,
+                           std::shared_ptr<const WallTree> walls) {
+  n_fluid_ = 0;
+  for (const Particle& p : particles) {
+    if (p.type == FLUID) n_fluid_++;
+  }
+  n_particles_ = n_fluid_ + (walls ? walls->size() : (int)particles.size() - n_fluid_);
+  particles_i_.reserve(n_particles_);
+  particles_j_.reserve(n_particles_);
+  numa_first_touch(particles_i_.data(), n_particles_);
+  numa_first_touch(particles_j_.data(), n_particles_);
+#if SPH_TRACK_IDS
+  ids_i_.reserve(n_particles_);
+  ids_j_.reserve(n_particles_);
+  numa_first_touch(ids_i_.data(), n_particles_);
+  numa_first_touch(ids_j_.data(), n_particles_);
+#endif
+  // fluid particles are stored first, followed by walls
+  // (the id of a particle is its index in the input)
+  int n_fluid = 0;
+  for (int i = 0; i < (int)particles.size(); i++) {
+    if (particles[i].type != FLUID) continue;
+    if (ids_i_) ids_i_[n_fluid] = i;
+    particles_i_[n_fluid++] = particles[i];
   }
   root_ = NULL;
-}
-
-ParticleTree::~ParticleTree() {
-  delete_nodes(root_);
-#if SPH_LOOP_PARALLEL || SPH_CUDA_PARALLEL
-  destroy_global_array();
+  n_leafs_ = 0;
+  n_fluid_leafs_ = 0;
+#if SPH_DATAFLOW
+  deps_size_ = 0;
 #endif
-  delete[] particles_i_;
-  delete[] particles_j_;
+
+  // the wall tree is static
+  wall_root_ = NULL;
+  Particle* walls_i = particles_i_ + n_fluid_;
+  Particle* walls_j = particles_j_ + n_fluid_;
+  const int n_walls = n_particles_ - n_fluid_;
+  if (walls) {
+    std::copy(walls->particles_.begin(), walls->particles_.end(), walls_i);
+    if (ids_i_) std::copy(walls->ids_.begin(), walls->ids_.end(), ids_i_ + n_fluid_);
+    if (walls->root_) {
+      wall_root_ = clone_tree(wall_nodes_, walls->root_, walls->particles_.data(), walls_i, walls_j);
+    }
+    walls_ = walls;
+    return;
+  }
+
+  int n_wall = n_fluid_;
+  for (int i = 0; i < (int)particles.size(); i++) {
+    if (particles[i].type == FLUID) continue;
+    if (ids_i_) ids_i_[n_wall] = i;
+    particles_i_[n_wall++] = particles[i];
+  }
+  std::shared_ptr<WallTree> built = std::make_shared<WallTree>();
+  if (n_walls > 0) {
+    BoundingBox bbox = get_bbox(walls_i, n_walls).square();
+    wall_root_ = build_tree(wall_nodes_, walls_i, walls_j,
+                            offset_ids(ids_i_, n_fluid_), offset_ids(ids_j_, n_fluid_),
+                            n_walls, bbox, false);
+    refine_bbox(wall_root_);
+    search_static_neighbors(*built);
+    built->particles_.assign(walls_i, walls_i + n_walls);
+    if (ids_i_) built->ids_.assign(ids_i_ + n_fluid_, ids_i_ + n_particles_);
+    built->root_ = clone_tree(built->nodes_, wall_root_, walls_i, built->particles_.data(), NULL);
+  }
+  walls_ = built;
 }
 
+// rebuild the fluid tree
 void ParticleTree::build() {
-  if (root_) {
-    delete_nodes(root_);
-#if SPH_LOOP_PARALLEL || SPH_CUDA_PARALLEL
-    destroy_global_array();
+  TRACE_SCOPE("build_tree");
+  nodes_.reset();
+  BoundingBox bbox = get_bbox(particles_i_, n_fluid_).square();
+  root_ = build_tree(nodes_, particles_i_, particles_j_, ids_i_, ids_j_, n_fluid_, bbox, false);
+  refine_bbox(root_);
+  index_leaves();
+  search_neighbors();
+#if SPH_HOST_PARALLEL || SPH_CUDA_PARALLEL
+  setup_global_array();
 #endif
+}
+
+// keep the partitioning of the fluid tree and only update its bounding boxes
+void ParticleTree::refit() {
+  TRACE_SCOPE("refit_tree");
+  if (!root_) {
+    build();
+    return;
   }
-  BoundingBox bbox = get_bbox(particles_i_, n_particles_).square();
-  root_ = build_tree(particles_i_, particles_j_, n_particles_, bbox, false);
   refine_bbox(root_);
-  search_neighbors(root_);
-#if SPH_LOOP_PARALLEL || SPH_CUDA_PARALLEL
+  search_neighbors();
+#if SPH_HOST_PARALLEL || SPH_CUDA_PARALLEL
   setup_global_array();
 #endif
 }
 
-#if SPH_LOOP_PARALLEL || SPH_CUDA_PARALLEL
-void ParticleTree::setup_global_array() {
-  int idx = 0;
-  int acc_neighbors = 0;
+// Move the fluid leaves in memory into the order of a Morton curve over
+// their current centers. Refits keep the partition of the last build while
+// the particles drift, so leaves that are neighbors now may lie far apart in
+// memory; this restores the locality of the gathers without a rebuild.
+//
+// Only the ranges of the leaves move, not the leaves themselves: leaf_array_,
+// the leaf indices and the neighbor lists stay valid. The ranges of the inner
+// nodes are stale afterwards, but nothing reads them after the build (their
+// bounding boxes are merged from the children), and build() starts over from
+// the whole fluid range.
+void ParticleTree::reorder() {
+  TRACE_SCOPE("reorder");
+  const int n = n_fluid_leafs_;
+  std::vector<realvec> centers(n);
+  parallel_for(0, n, [&] (int idx) {
+    const ParticleTreeNode* leaf = leaf_array_[idx];
+    centers[idx] = get_bbox(leaf->particles_i, leaf->n_particles).center();
+  });
+  BoundingBox bbox;
+  for (int idx = 0; idx < n; idx++) {
+    bbox.merge(centers[idx]);
+  }
+  std::vector<std::pair<uint32_t, int>> keys(n);
+  for (int idx = 0; idx < n; idx++) {
+    keys[idx] = std::make_pair(morton_key(centers[idx], bbox), idx);
+  }
+  std::sort(keys.begin(), keys.end());
+
+  // new offset of each leaf, then copy through particles_j_
+  std::vector<int> offsets(n);
+  int offset = 0;
+  for (int k = 0; k < n; k++) {
+    offsets[keys[k].second] = offset;
+    offset += leaf_array_[keys[k].second]->n_particles;
+  }
+  parallel_for(0, n, [&] (int idx) {
+    const ParticleTreeNode* leaf = leaf_array_[idx];
+    const int from = leaf->particles_i - particles_i_;
+    std::copy(leaf->particles_i, leaf->particles_i + leaf->n_particles, particles_j_ + offsets[idx]);
+    if (ids_i_) std::copy(ids_i_ + from, ids_i_ + from + leaf->n_particles, ids_j_ + offsets[idx]);
+  });
+  parallel_for(0, n, [&] (int idx) {
+    ParticleTreeNode* leaf = leaf_array_[idx];
+    const int to = offsets[idx];
+    leaf->particles_i = particles_i_ + to;
+    leaf->particles_j = particles_j_ + to;
+    std::copy(particles_j_ + to, particles_j_ + to + leaf->n_particles, particles_i_ + to);
+    if (ids_i_) std::copy(ids_j_ + to, ids_j_ + to + leaf->n_particles, ids_i_ + to);
+  });
+#if SPH_HOST_PARALLEL || SPH_CUDA_PARALLEL
+  setup_global_array();
+#endif
+}
 
+void ParticleTree::index_leaves() {
+  leaf_array_.clear();
   for_leaf_impl(root_, [&] (ParticleTreeNode* leaf) {
-    leaf->index = idx++;
-    acc_neighbors += leaf->n_neighbors;
+    leaf->index = leaf_array_.size();
+    leaf_array_.push_back(leaf);
   });
+  n_fluid_leafs_ = leaf_array_.size();
+  if (wall_root_) {
+    for_leaf_impl(wall_root_, [&] (ParticleTreeNode* leaf) {
+      leaf->index = leaf_array_.size();
+      leaf_array_.push_back(leaf);
+    });
+  }
+  n_leafs_ = leaf_array_.size();
+}
 
-  n_leafs_ = idx;
-  pi_offsets_ = new int[n_leafs_ + 1];
-  pj_offsets_ = new int[n_leafs_ + 1];
-  leaf_array_ = new ParticleTreeNode*[n_leafs_];
+// Expand the given node pairs breadth-first until there are enough of them
+// to keep all threads busy, then walk each of them in parallel. Leaf pairs
+// are collected per task.
+void ParticleTree::collect_leaf_pairs(std::vector<NodePair>& frontier) {
+  std::vector<NodePair> next;
+  while ((int)frontier.size() < SPH_TRAVERSE_TASKS) {
+    bool expanded = false;
+    next.clear();
+    for (const auto& p : frontier) {
+      if (!p.a->outer_bbox.intersect(p.b->inner_bbox)) continue;
+      if (p.a->is_leaf && p.b->is_leaf) {
+        next.push_back(p);
+      } else {
+        split_pair(p.a, p.b, [&] (const ParticleTreeNode* c1, const ParticleTreeNode* c2) {
+          next.push_back({c1, c2});
+        });
+        expanded = true;
+      }
+    }
+    frontier.swap(next);
+    if (!expanded) break;
+  }
 
-  pj_buf_size_ = acc_neighbors;
-  pj_buf_ = new Particle[pj_buf_size_];
+  const int n_tasks = frontier.size();
+  if ((int)task_pairs_.size() < n_tasks) task_pairs_.resize(n_tasks);
+  n_tasks_ = n_tasks;
+  parallel_for(0, n_tasks, [&] (int t) {
+    std::vector<LeafPair>& pairs = task_pairs_[t];
+    pairs.clear();
+    dual_traverse(frontier[t].a, frontier[t].b, [&] (const ParticleTreeNode* a, const ParticleTreeNode* b) {
+      pairs.push_back({a->index, b->index});
+    });
+  });
+}
 
-  int pi_acc = 0;
-  int pj_acc = 0;
-  // scan (prefix sum)
-  pi_offsets_[0] = 0;
-  pj_offsets_[0] = 0;
-  for_leaf_impl(root_, [&] (ParticleTreeNode* leaf) {
-    int idx = leaf->index;
-    pi_acc += leaf->n_particles;
-    pi_offsets_[idx + 1] = pi_acc;
-    pj_acc += leaf->n_neighbors;
-    pj_offsets_[idx + 1] = pj_acc;
+// Turn the collected leaf pairs into symmetric CSR lists over n leaves.
+// offsets[i + 1] must hold the number of extra slots to be reserved at the
+// end of list i; cursor[i] is left at the first of them.
+void ParticleTree::pairs_to_csr(const int n, std::vector<int>& offsets,
+                                std::vector<int>& indices, std::vector<int>& cursor) {
+  parallel_for(0, n_tasks_, [&] (int t) {
+    for (const auto& p : task_pairs_[t]) {
+      __atomic_fetch_add(&offsets[p.a + 1], 1, __ATOMIC_RELAXED);
+      if (p.a != p.b) __atomic_fetch_add(&offsets[p.b + 1], 1, __ATOMIC_RELAXED);
+    }
+  });
+  offsets[0] = 0;
+  for (int i = 0; i < n; i++) {
+    offsets[i + 1] += offsets[i];
+  }
+  indices.resize(offsets[n]);
+  cursor.assign(offsets.begin(), offsets.begin() + n);
+  parallel_for(0, n_tasks_, [&] (int t) {
+    for (const auto& p : task_pairs_[t]) {
+      indices[__atomic_fetch_add(&cursor[p.a], 1, __ATOMIC_RELAXED)] = p.b;
+      if (p.a != p.b) indices[__atomic_fetch_add(&cursor[p.b], 1, __ATOMIC_RELAXED)] = p.a;
+    }
+  });
+}
+
+// wall-wall neighbors never change, so they are searched only once
+void ParticleTree::search_static_neighbors(WallTree& walls) {
+  std::vector<ParticleTreeNode*> wall_leafs;
+  for_leaf_impl(wall_root_, [&] (ParticleTreeNode* leaf) {
+    leaf->index = wall_leafs.size();
+    wall_leafs.push_back(leaf);
+  });
+  const int n_wall_leafs = wall_leafs.size();
+
+  std::vector<NodePair> frontier = {{wall_root_, wall_root_}};
+  collect_leaf_pairs(frontier);
+  std::vector<int>& offsets = walls.offsets_;
+  std::vector<int>& indices = walls.indices_;
+  offsets.assign(n_wall_leafs + 1, 0);
+  pairs_to_csr(n_wall_leafs, offsets, indices, nb_cursor_);
+  parallel_for(0, n_wall_leafs, [&] (int w) {
+    std::sort(&indices[offsets[w]], &indices[offsets[w + 1]]);
+    int n_neighbors = 0;
+    for (int k = offsets[w]; k < offsets[w + 1]; k++) {
+      n_neighbors += wall_leafs[indices[k]]->n_particles;
+    }
+    wall_leafs[w]->n_static_neighbors = n_neighbors;
+  });
+}
+
+// Neighbor lists are found by a dual-tree traversal of the fluid tree with
+// itself and with the wall tree, and are sorted by leaf index so that the
+// gather order does not depend on the traversal schedule. Wall leaves get
+// their static wall neighbors appended.
+void ParticleTree::search_neighbors() {
+  TRACE_SCOPE("neighbor_search");
+  std::vector<NodePair> frontier = {{root_, root_}};
+  if (wall_root_) frontier.push_back({root_, wall_root_});
+  collect_leaf_pairs(frontier);
+
+  const std::vector<int>& static_offsets = walls_->offsets_;
+  const std::vector<int>& static_indices = walls_->indices_;
+  nb_offsets_.assign(n_leafs_ + 1, 0);
+  for (int idx = n_fluid_leafs_; idx < n_leafs_; idx++) {
+    const int w = idx - n_fluid_leafs_;
+    nb_offsets_[idx + 1] = static_offsets[w + 1] - static_offsets[w];
+  }
+  pairs_to_csr(n_leafs_, nb_offsets_, nb_indices_, nb_cursor_);
 
-    leaf_array_[idx] = leaf;
+  parallel_for(0, n_leafs_, [&] (int idx) {
+    ParticleTreeNode* leaf = leaf_array_[idx];
+    std::sort(&nb_indices_[nb_offsets_[idx]], &nb_indices_[nb_cursor_[idx]]);
+    if (idx >= n_fluid_leafs_) {
+      const int w = idx - n_fluid_leafs_;
+      int* out = &nb_indices_[nb_cursor_[idx]];
+      for (int k = static_offsets[w]; k < static_offsets[w + 1]; k++) {
+        *out++ = n_fluid_leafs_ + static_indices[k];
+      }
+    }
+    int n_neighbors = 0;
+    for_neighbor(leaf, [&] (const ParticleTreeNode* nb) {
+      n_neighbors += nb->n_particles;
+    });
+    leaf->n_neighbors = n_neighbors;
+  });
+}
+
+double ParticleTree::mean_fluid_neighbors() const {
+  constexpr real slen2 = SLEN * SLEN;
+  long n_pairs = reduce_leaf(0L, [&] (const ParticleTreeNode* leaf) {
+    long n = 0;
+    for_neighbor(leaf, [&] (const ParticleTreeNode* nb) {
+      for (int i = 0; i < leaf->n_fluid; i++) {
+        for (int j = 0; j < nb->n_particles; j++) {
+          const realvec dr = leaf->particles_i[i].pos - nb->particles_i[j].pos;
+          if (dr * dr < slen2) n++;
+        }
+      }
+    });
+    return n;
+  }, sum_op());
+  return n_fluid_ ? (double)n_pairs / n_fluid_ : 0.0;
+}
+
+inline int node_depth(const ParticleTreeNode* node) {
+  int depth = 0;
+  if (!node->is_leaf) {
+    for (int i = 0; i < (1 << DIM); i++) {
+      if (const ParticleTreeNode* child = node->children[i]) {
+        depth = max_(depth, node_depth(child) + 1);
+      }
+    }
+  }
+  return depth;
+}
+
+int ParticleTree::depth() const {
+  return root_ ? node_depth(root_) : 0;
+}
+
+#if SPH_BLOCK_DT
+// Count active fluid particles per leaf so that calc() can skip idle leaves.
+// Walls have no rung of their own; their density is recomputed whenever
+// some fluid particle within their neighbor leaves is active.
+void ParticleTree::count_active() {
+  TRACE_SCOPE("count_active");
+  pfor_leaf([&] (ParticleTreeNode* leaf) {
+    int n_active = 0;
+    for (int i = 0; i < leaf->n_fluid; i++) {
+      if (leaf->particles_i[i].active) n_active++;
+    }
+    leaf->n_active = n_active;
+  });
+  pfor_leaf([&] (ParticleTreeNode* leaf) {
+    bool walls_active = false;
+    if (leaf->n_fluid < leaf->n_particles) {
+      for_neighbor(leaf, [&] (const ParticleTreeNode* nb) {
+        if (nb->n_active > 0) walls_active = true;
+      });
+      for (int i = leaf->n_fluid; i < leaf->n_particles; i++) {
+        leaf->particles_i[i].active = walls_active;
+      }
+    }
+    leaf->walls_active = walls_active;
   });
 }
+#endif
+
+#if SPH_HOST_PARALLEL || SPH_CUDA_PARALLEL
+void ParticleTree::setup_global_array() {
+  TRACE_SCOPE("setup_gather");
+  pi_offsets_.resize(n_leafs_);
+  pi_ends_.resize(n_leafs_);
+  pf_offsets_.resize(n_leafs_);
+  pj_offsets_.resize(n_leafs_);
+  batch_offsets_.assign(1, 0);
+
+#if SPH_GATHER_BUDGET
+  const int budget = ((size_t)SPH_GATHER_BUDGET << 20) / sizeof(Particle);
+#endif
+  int pj_acc = 0;
+  pj_buf_size_ = 0;
+  // scan (prefix sum), starting a new batch whenever the neighbors of a leaf
+  // do not fit into the budget any more (a leaf may exceed it on its own)
+  for (int idx = 0; idx < n_leafs_; idx++) {
+    ParticleTreeNode* leaf = leaf_array_[idx];
+#if SPH_GATHER_BUDGET
+    if (pj_acc > 0 && pj_acc + leaf->n_neighbors > budget) {
+      batch_offsets_.push_back(idx);
+      pj_acc = 0;
+    }
+#endif
+    pi_offsets_[idx] = leaf->particles_i - particles_i_;
+    pi_ends_[idx]    = pi_offsets_[idx] + leaf->n_particles;
+    pf_offsets_[idx] = pi_offsets_[idx] + leaf->n_fluid;
+    pj_offsets_[idx] = pj_acc;
+    pj_acc += leaf->n_neighbors;
+    pj_buf_size_ = max_(pj_buf_size_, pj_acc);
+  }
+  if (n_leafs_ > 0) batch_offsets_.push_back(n_leafs_);
 
-void ParticleTree::destroy_global_array() {
-  delete[] pi_offsets_;
-  delete[] pj_offsets_;
-  delete[] pj_buf_;
-  delete[] leaf_array_;
+  // leave some headroom so that the buffer is not remapped on every rebuild,
+  // but not beyond the budget
+#if SPH_GATHER_BUDGET
+  const double growth = max_(1.0, min_(1.2, (double)budget / max_(pj_buf_size_, 1)));
+#else
+  const double growth = 1.2;
+#endif
+  const bool remapped = pj_buf_.reserve(pj_buf_size_, growth);
+
+  // first touch with the same leaf-to-thread mapping as calc(), so that each
+  // gather buffer is placed on the node of the thread that fills it (with
+  // several batches, on that of the first batch using the page)
+  if (remapped) {
+    for (int b = 0; b < gather_batches(); b++) {
+      parallel_for(batch_offsets_[b], batch_offsets_[b + 1], [&] (int idx) {
+        Particle* ps_j = &pj_buf_[pj_offsets_[idx]];
+        for (int j = 0; j < leaf_array_[idx]->n_neighbors; j++) {
+          new (&ps_j[j]) Particle();
+        }
+      });
+    }
+  }
 }
 #endif
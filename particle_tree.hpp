@@ -1,55 +1,113 @@
 #pragma once
 
+#include <atomic>
+#include <memory>
+#include <new>
 #include <vector>
 
 #include "config.hpp"
 #include "defs.hpp"
+#include "numa.hpp"
+#include "buffer.hpp"
+#include "trace.hpp"
 
 typedef struct ParticleTreeNode {
   Particle*                             particles_i;
   Particle*                             particles_j; // TODO: remove?
   int                                   n_particles;
+  int                                   n_fluid; // fluid particles come first in a leaf
   bool                                  is_leaf;
   BoundingBox                           bbox;
   BoundingBox                           inner_bbox;
   BoundingBox                           outer_bbox;
   struct ParticleTreeNode*              children[(1 << DIM)];
-  std::vector<struct ParticleTreeNode*> neighbors;
   int                                   n_neighbors;
-#if SPH_LOOP_PARALLEL || SPH_CUDA_PARALLEL
-  int                                   index;
+  int                                   n_static_neighbors; // wall leaves: wall neighbors
+#if SPH_BLOCK_DT
+  int                                   n_active;
+  bool                                  walls_active;
 #endif
+  int                                   index;
 #if SPH_RECORD_CPU
   int                                   cpu;
+  int                                   node;
 #endif
 
   ParticleTreeNode(Particle* ps_i, Particle* ps_j, const int n, BoundingBox bb)
-    : particles_i(ps_i), particles_j(ps_j), n_particles(n), is_leaf(false), bbox(bb) {}
+    : particles_i(ps_i), particles_j(ps_j), n_particles(n), is_leaf(false), bbox(bb) {
+#if SPH_RECORD_CPU
+    cpu  = -1;
+    node = -1;
+#endif
+  }
 } ParticleTreeNode;
 
+// Nodes are carved out of chunks that are kept across rebuilds, so that
+// building and discarding a tree does not allocate in steady state.
+class NodeArena {
+  private:
+    static constexpr int           CHUNK_SIZE = 1024;
+    std::vector<ParticleTreeNode*> chunks_;
+    int                            n_nodes_;
+
+  public:
+    NodeArena() : n_nodes_(0) {}
+    NodeArena(const NodeArena&) = delete;
+    NodeArena& operator = (const NodeArena&) = delete;
+    ~NodeArena() {
+      for (auto chunk : chunks_) ::operator delete(chunk);
+    }
+
+    ParticleTreeNode* alloc(Particle* ps_i, Particle* ps_j, const int n, BoundingBox bb) {
+      const int c = n_nodes_ / CHUNK_SIZE;
+      if (c == (int)chunks_.size()) {
+        chunks_.push_back(static_cast<ParticleTreeNode*>(
+              ::operator new(sizeof(ParticleTreeNode) * CHUNK_SIZE)));
+      }
+      ParticleTreeNode* node = &chunks_[c][n_nodes_ % CHUNK_SIZE];
+      n_nodes_++;
+      return new (node) ParticleTreeNode(ps_i, ps_j, n, bb);
+    }
+
+    // nodes are trivially destructible
+    void reset() {
+      n_nodes_ = 0;
+    }
+
+    int size() const {
+      return n_nodes_;
+    }
+};
+
+
 template <typename Func>
-inline void pfor_leaf_impl(ParticleTreeNode* node, const Func body) {
+inline void for_leaf_impl(ParticleTreeNode* node, const Func body) {
   if (node->is_leaf) {
     body(node);
   } else {
     for (int i = 0; i < (1 << DIM); i++) {
       if (ParticleTreeNode* child = node->children[i]) {
-        pfor_leaf_impl(child, body);
+        for_leaf_impl(child, body);
       }
     }
   }
 }
 
+// children are visited as parallel tasks down to SPH_TASK_CUTOFF particles
 template <typename Func>
-inline void for_leaf_impl(ParticleTreeNode* node, const Func body) {
+inline void pfor_leaf_impl(ParticleTreeNode* node, const Func body) {
   if (node->is_leaf) {
     body(node);
+  } else if (node->n_particles <= SPH_TASK_CUTOFF) {
+    for_leaf_impl(node, body);
   } else {
+    TaskGroup tg;
     for (int i = 0; i < (1 << DIM); i++) {
       if (ParticleTreeNode* child = node->children[i]) {
-        for_leaf_impl(child, body);
+        tg.run([=] { pfor_leaf_impl(child, body); });
       }
     }
+    tg.wait();
   }
 }
 
@@ -65,10 +123,10 @@ inline void cudaAssert(cudaError_t code, const char *file, int line) {
 template <typename Func>
 __global__
 static void on_gpu(Particle* ps_i, Particle* ps_j, int np,
-                   int* pi_offsets, int* pj_offsets, Func body) {
+                   int* pi_offsets, int* pi_ends, int* pj_offsets, Func body) {
   int l = blockIdx.x;
   int ibegin = pi_offsets[l];
-  int iend   = pi_offsets[l + 1];
+  int iend   = pi_ends[l];
 
   int ni = (iend - ibegin + blockDim.x - 1) / blockDim.x;
   int ibegin_ = ibegin + threadIdx.x * ni;
@@ -87,103 +145,300 @@ static void on_gpu(Particle* ps_i, Particle* ps_j, int np,
 }
 #endif
 
+// The static wall tree of a geometry: the walls in tree order, the leaf
+// partition and the wall-wall neighbor lists. It is built by the first
+// ParticleTree of a geometry and only read afterwards, so runs with the same
+// walls can share it (see the ensemble in sph.cpp). Every ParticleTree still
+// copies the wall particles, whose densities change, and clones the nodes
+// onto its copy.
+class WallTree {
+  private:
+    std::vector<Particle> particles_;
+    std::vector<int>      ids_;      // input indices (empty unless SPH_TRACK_IDS)
+    NodeArena             nodes_;
+    ParticleTreeNode*     root_;
+    // neighbors of wall leaf w (in the order of for_leaf_impl) are
+    // indices_[offsets_[w] .. offsets_[w + 1])
+    std::vector<int>      offsets_;
+    std::vector<int>      indices_;
+
+    friend class ParticleTree;
+
+  public:
+    WallTree() : root_(NULL) {}
+    WallTree(const WallTree&) = delete;
+    WallTree& operator = (const WallTree&) = delete;
+
+    int size() const {
+      return particles_.size();
+    }
+};
+
 class ParticleTree {
   private:
-    int                n_particles_;
-    Particle*          particles_i_;
-    Particle*          particles_j_;
-    ParticleTreeNode*  root_;
-#if SPH_LOOP_PARALLEL || SPH_CUDA_PARALLEL
-    int                n_leafs_;
-    int*               pi_offsets_;
-    int*               pj_offsets_;
-    int                pj_buf_size_;
-    Particle*          pj_buf_;
-    ParticleTreeNode** leaf_array_;
+    int                            n_particles_;
+    int                            n_fluid_;
+    LargeBuffer<Particle>          particles_i_; // fluid particles first, then walls
+    LargeBuffer<Particle>          particles_j_;
+    LargeBuffer<int>               ids_i_;       // input index of each particle
+    LargeBuffer<int>               ids_j_;       // (empty unless SPH_TRACK_IDS)
+    ParticleTreeNode*              root_;        // rebuilt or refitted
+    ParticleTreeNode*              wall_root_;   // a clone of walls_
+    NodeArena                      nodes_;
+    NodeArena                      wall_nodes_;
+    // fluid leaves first, then wall leaves
+    int                            n_leafs_;
+    int                            n_fluid_leafs_;
+    std::vector<ParticleTreeNode*> leaf_array_;
+    // neighbor leaves of leaf i are nb_indices_[nb_offsets_[i] .. nb_offsets_[i + 1])
+    std::vector<int>               nb_offsets_;
+    std::vector<int>               nb_indices_;
+    std::shared_ptr<const WallTree> walls_;
+#if SPH_HOST_PARALLEL || SPH_CUDA_PARALLEL
+    // particles of leaf i are [pi_offsets_[i], pi_ends_[i]) in particles_i_,
+    // its fluid ones end at pf_offsets_[i] (leaves are not in memory order
+    // after a reorder)
+    std::vector<int>               pi_offsets_;
+    std::vector<int>               pi_ends_;
+    std::vector<int>               pf_offsets_;
+    // leaves of batch b are batch_offsets_[b] .. batch_offsets_[b + 1]; the
+    // gathered neighbors of leaf i start at pj_offsets_[i] in the buffer of
+    // its batch, which is shared by all batches
+    std::vector<int>               batch_offsets_;
+    std::vector<int>               pj_offsets_;
+    int                            pj_buf_size_;
+    LargeBuffer<Particle>          pj_buf_;      // reused across rebuilds
 #endif
 
+    // leaf pairs found by the dual-tree traversal, per parallel task
+    typedef struct { const ParticleTreeNode* a; const ParticleTreeNode* b; } NodePair;
+    typedef struct { int a; int b; } LeafPair;
+    int                                n_tasks_;
+    std::vector<std::vector<LeafPair>> task_pairs_;
+    std::vector<int>                   nb_cursor_;
+#if SPH_DATAFLOW
+    // unfinished neighbors of each leaf, per stage of calc_dataflow
+    std::unique_ptr<std::atomic<int>[]> deps_;
+    int                                 deps_size_;
+
+    template <typename Func>
+    void dataflow_task(TaskGroup& tg, const int idx, const int stage,
+                       const int n_stages, const Func& body) {
+      body(leaf_array_[idx], stage);
+      if (stage + 1 == n_stages) return;
+      std::atomic<int>* next = &deps_[(stage + 1) * n_leafs_];
+      for (int k = nb_offsets_[idx]; k < nb_offsets_[idx + 1]; k++) {
+        const int nb = nb_indices_[k];
+        if (next[nb].fetch_sub(1, std::memory_order_acq_rel) == 1) {
+          tg.run([this, &tg, nb, stage, n_stages, &body] {
+            dataflow_task(tg, nb, stage + 1, n_stages, body);
+          });
+        }
+      }
+    }
+#endif
+
+    void index_leaves();
+    void collect_leaf_pairs(std::vector<NodePair>& frontier);
+    void pairs_to_csr(const int n, std::vector<int>& offsets,
+                      std::vector<int>& indices, std::vector<int>& cursor);
+    void search_static_neighbors(WallTree& walls);
+    void search_neighbors();
+
+    // copy the particles of the neighbor leaves of leaf into ps_j
+    void gather_neighbors(const ParticleTreeNode* leaf, Particle* ps_j) const {
+      TRACE_SCOPE("gather", leaf->index);
+      int c = 0;
+      for_neighbor(leaf, [&] (const ParticleTreeNode* nb) {
+        for (int j = 0; j < nb->n_particles; j++) {
+          ps_j[c++] = nb->particles_i[j];
+        }
+      });
+    }
+
   public:
-    ParticleTree(const std::vector<Particle>& particles);
-    ~ParticleTree();
+    // The walls are built from particles unless the WallTree of the same
+    // geometry (from walls() of another tree) is given.
+    ParticleTree(const std::vector<Particle>& particles,
+                 std::shared_ptr<const WallTree> walls = NULL);
+
+    std::shared_ptr<const WallTree> walls() const {
+      return walls_;
+    }
 
     void build();
+    void refit();
+    void reorder();
 
-    template <typename Func>
-    void calc(const Func body) {
-#if SPH_LOOP_PARALLEL
-#pragma omp parallel for
+#if SPH_BLOCK_DT
+    void count_active();
+#endif
+
+    // average number of particles within SLEN of a fluid particle
+    double mean_fluid_neighbors() const;
+
+    // number of levels below the root of the fluid tree
+    int depth() const;
+
+    // pairs the kernels of calc() loop over, for all particles of the leaves
+    // or only the fluid ones
+    long candidate_pairs(const bool fluid_only) const {
+      long n = 0;
       for (int idx = 0; idx < n_leafs_; idx++) {
-        ParticleTreeNode* leaf = leaf_array_[idx];
-#if SPH_RECORD_CPU
-        leaf->cpu = sched_getcpu();
-#endif
-        Particle* ps_i = leaf->particles_i;
-        Particle* ps_j = &pj_buf_[pj_offsets_[idx]];
-        int c = 0;
-        for (const auto& nb : leaf->neighbors) {
-          for (int j = 0; j < nb->n_particles; j++) {
-            ps_j[c++] = nb->particles_i[j];
-          }
-        }
+        const ParticleTreeNode* leaf = leaf_array_[idx];
+        n += (long)(fluid_only ? leaf->n_fluid : leaf->n_particles) * leaf->n_neighbors;
+      }
+      return n;
+    }
+
+    // size of the gather buffer of calc() (0 without one); it only grows, so
+    // this is also its peak
+    size_t gather_bytes() const {
+#if SPH_HOST_PARALLEL || SPH_CUDA_PARALLEL
+      return pj_buf_.bytes();
+#else
+      return 0;
+#endif
+    }
+
+    // number of batches calc() runs the leaves in
+    int gather_batches() const {
+#if SPH_HOST_PARALLEL || SPH_CUDA_PARALLEL
+      return max_(0, (int)batch_offsets_.size() - 1);
+#else
+      return 1;
+#endif
+    }
+
+    // particle arrays (both copies, and the ids if tracked)
+    size_t particle_bytes() const {
+      return particles_i_.bytes() + particles_j_.bytes() + ids_i_.bytes() + ids_j_.bytes();
+    }
 
-        int ni = leaf->n_particles;
-        int nj = leaf->n_neighbors;
+    // Apply body to one leaf and its gathered neighbors. If fluid_only is set,
+    // body is applied only to the fluid particles of the leaf and wall-only
+    // leaves are skipped.
+    template <typename Func>
+    void calc_leaf(const int idx, const Func body, const bool fluid_only = false) {
+      ParticleTreeNode* leaf = leaf_array_[idx];
+      if (fluid_only && leaf->n_fluid == 0) return;
+#if SPH_BLOCK_DT
+      if (leaf->n_active == 0 && (fluid_only || !leaf->walls_active)) return;
+#endif
+#if SPH_RECORD_CPU
+      leaf->cpu  = sched_getcpu();
+      leaf->node = numa_current_node();
+#endif
+      int nj = leaf->n_neighbors;
+#if SPH_HOST_PARALLEL
+      Particle* ps_j = &pj_buf_[pj_offsets_[idx]];
+#else
+      Particle* ps_j = new Particle[nj];
+#endif
+      gather_neighbors(leaf, ps_j);
+      Particle* ps_i = leaf->particles_i;
+      int ni = fluid_only ? leaf->n_fluid : leaf->n_particles;
+      {
+        TRACE_SCOPE("kernel", idx);
         body(ps_i, ni, ps_j, nj);
       }
-#elif SPH_CUDA_PARALLEL
-      pfor_leaf_impl(root_, [&] (ParticleTreeNode* leaf) {
-        int idx = leaf->index;
-        Particle* ps_j = &pj_buf_[pj_offsets_[idx]];
-        int c = 0;
-        for (const auto& nb : leaf->neighbors) {
-          for (int j = 0; j < nb->n_particles; j++) {
-            ps_j[c++] = nb->particles_i[j];
-          }
+#if !SPH_HOST_PARALLEL
+      delete[] ps_j;
+#endif
+    }
+
+#if SPH_DATAFLOW
+    // Run body(leaf, stage) for stages 0 .. n_stages - 1 of every leaf as a
+    // task graph instead of one global phase per stage. Stage s of a leaf
+    // starts as soon as stage s - 1 has finished on all of its neighbor
+    // leaves (itself included): everything it gathers is then final, and as
+    // the neighbor lists are symmetric no leaf still gathers from it.
+    template <typename Func>
+    void calc_dataflow(const int n_stages, const Func body) {
+      const int n = n_stages * n_leafs_;
+      if (n > deps_size_) {
+        deps_.reset(new std::atomic<int>[n]);
+        deps_size_ = n;
+      }
+      parallel_for(0, n_leafs_, [&] (int idx) {
+        const int n_nb = nb_offsets_[idx + 1] - nb_offsets_[idx];
+        for (int s = 1; s < n_stages; s++) {
+          deps_[s * n_leafs_ + idx].store(n_nb, std::memory_order_relaxed);
         }
       });
+      TaskGroup tg;
+      for (int idx = 0; idx < n_leafs_; idx++) {
+        tg.run([this, &tg, idx, n_stages, &body] {
+          dataflow_task(tg, idx, 0, n_stages, body);
+        });
+      }
+      tg.wait();
+    }
+#endif
 
+    template <typename Func>
+    void calc(const Func body, const bool fluid_only = false) {
+#if SPH_CUDA_PARALLEL
       Particle* d_ps_i;
       Particle* d_ps_j;
       int*      d_pi_offsets;
+      int*      d_pi_ends;
       int*      d_pj_offsets;
 
       cudaCheckError(cudaMalloc(&d_ps_i, sizeof(Particle) * n_particles_));
       cudaCheckError(cudaMalloc(&d_ps_j, sizeof(Particle) * pj_buf_size_));
-      cudaCheckError(cudaMalloc(&d_pi_offsets, sizeof(int) * (n_leafs_ + 1)));
+      cudaCheckError(cudaMalloc(&d_pi_offsets, sizeof(int) * n_leafs_));
+      cudaCheckError(cudaMalloc(&d_pi_ends, sizeof(int) * n_leafs_));
       cudaCheckError(cudaMalloc(&d_pj_offsets, sizeof(int) * (n_leafs_ + 1)));
 
       cudaCheckError(cudaMemcpy(d_ps_i, particles_i_, sizeof(Particle) * n_particles_, cudaMemcpyHostToDevice));
-      cudaCheckError(cudaMemcpy(d_ps_j, pj_buf_     , sizeof(Particle) * pj_buf_size_, cudaMemcpyHostToDevice));
-      cudaCheckError(cudaMemcpy(d_pi_offsets, pi_offsets_, sizeof(int) * (n_leafs_ + 1), cudaMemcpyHostToDevice));
-      cudaCheckError(cudaMemcpy(d_pj_offsets, pj_offsets_, sizeof(int) * (n_leafs_ + 1), cudaMemcpyHostToDevice));
+      cudaCheckError(cudaMemcpy(d_pi_offsets, pi_offsets_.data(), sizeof(int) * n_leafs_, cudaMemcpyHostToDevice));
+      cudaCheckError(cudaMemcpy(d_pi_ends, fluid_only ? pf_offsets_.data() : pi_ends_.data(), sizeof(int) * n_leafs_, cudaMemcpyHostToDevice));
 
-      on_gpu<<<n_leafs_, 32>>>(d_ps_i, d_ps_j, n_particles_, d_pi_offsets, d_pj_offsets, body);
-      cudaCheckError(cudaPeekAtLastError());
-      cudaCheckError(cudaDeviceSynchronize());
+      std::vector<int> pj_batch(n_leafs_ + 1);
+      for (int b = 0; b < gather_batches(); b++) {
+        const int first = batch_offsets_[b];
+        const int last  = batch_offsets_[b + 1];
+        parallel_for(first, last, [&] (int idx) {
+          ParticleTreeNode* leaf = leaf_array_[idx];
+          if (fluid_only && leaf->n_fluid == 0) return;
+#if SPH_BLOCK_DT
+          if (leaf->n_active == 0 && (fluid_only || !leaf->walls_active)) return;
+#endif
+          gather_neighbors(leaf, &pj_buf_[pj_offsets_[idx]]);
+        });
+        // offsets of the batch, closed by its size
+        const int n_j = pj_offsets_[last - 1] + leaf_array_[last - 1]->n_neighbors;
+        for (int idx = first; idx < last; idx++) {
+          pj_batch[idx - first] = pj_offsets_[idx];
+        }
+        pj_batch[last - first] = n_j;
+
+        cudaCheckError(cudaMemcpy(d_ps_j, pj_buf_, sizeof(Particle) * n_j, cudaMemcpyHostToDevice));
+        cudaCheckError(cudaMemcpy(d_pj_offsets, pj_batch.data(), sizeof(int) * (last - first + 1), cudaMemcpyHostToDevice));
+
+        on_gpu<<<last - first, 32>>>(d_ps_i, d_ps_j, n_particles_, d_pi_offsets + first, d_pi_ends + first, d_pj_offsets, body);
+        cudaCheckError(cudaPeekAtLastError());
+        cudaCheckError(cudaDeviceSynchronize());
+      }
 
       cudaCheckError(cudaMemcpy(particles_i_, d_ps_i, sizeof(Particle) * n_particles_, cudaMemcpyDeviceToHost));
 
       cudaCheckError(cudaFree(d_ps_i));
       cudaCheckError(cudaFree(d_ps_j));
       cudaCheckError(cudaFree(d_pi_offsets));
+      cudaCheckError(cudaFree(d_pi_ends));
       cudaCheckError(cudaFree(d_pj_offsets));
+#elif SPH_HOST_PARALLEL
+      // batches run one after another, as they share the gather buffer
+      for (int b = 0; b < gather_batches(); b++) {
+        parallel_for(batch_offsets_[b], batch_offsets_[b + 1], [&] (int idx) {
+          calc_leaf(idx, body, fluid_only);
+        });
+      }
 #else
-      pfor_leaf_impl(root_, [&] (ParticleTreeNode* leaf) {
-#if SPH_RECORD_CPU
-        leaf->cpu = sched_getcpu();
-#endif
-        int nj = leaf->n_neighbors;
-        Particle* ps_j = new Particle[nj];
-        int c = 0;
-        for (const auto& nb : leaf->neighbors) {
-          for (int j = 0; j < nb->n_particles; j++) {
-            ps_j[c++] = nb->particles_i[j];
-          }
-        }
-        Particle* ps_i = leaf->particles_i;
-        int ni = leaf->n_particles;
-        body(ps_i, ni, ps_j, nj);
-        delete[] ps_j;
+      parallel_for(0, n_leafs_, [&] (int idx) {
+        calc_leaf(idx, body, fluid_only);
       });
 #endif
     }
@@ -195,6 +450,28 @@ class ParticleTree {
       }
     }
 
+#if SPH_TRACK_IDS
+    // body(p, id) in memory order
+    template <typename Func>
+    inline void for_particle_id(const Func body) {
+      for (int i = 0; i < n_particles_; i++) {
+        body(particles_i_[i], ids_i_[i]);
+      }
+    }
+
+    // body(p, id) in the order of the input
+    template <typename Func>
+    inline void for_particle_by_id(const Func body) {
+      std::vector<int> index(n_particles_);
+      for (int i = 0; i < n_particles_; i++) {
+        index[ids_i_[i]] = i;
+      }
+      for (int id = 0; id < n_particles_; id++) {
+        body(particles_i_[index[id]], id);
+      }
+    }
+#endif
+
     template <typename Func>
     inline void pfor_particle(const Func body) {
       parallel_for(0, n_particles_, [&] (int i) {
@@ -202,29 +479,98 @@ class ParticleTree {
       });
     }
 
+    // walls never move, so integration only visits the fluid part of leaves
+    template <typename Func>
+    inline void pfor_fluid_particle(const Func body) {
+      parallel_for(0, n_fluid_leafs_, [&] (int idx) {
+        ParticleTreeNode* leaf = leaf_array_[idx];
+        for (int i = 0; i < leaf->n_fluid; i++) {
+          body(leaf->particles_i[i]);
+        }
+      });
+    }
+
+    // the same particles straight from the array, also before the first build
+    template <typename Func>
+    inline void pfor_fluid_array(const Func body) {
+      parallel_for(0, n_fluid_, [&] (int i) {
+        body(particles_i_[i]);
+      });
+    }
+
     template <typename Func>
     inline void pfor_leaf(const Func body) {
-      pfor_leaf_impl(root_, body);
+      parallel_for(0, n_leafs_, [&] (int idx) {
+        body(leaf_array_[idx]);
+      });
+    }
+
+    int n_leafs() const {
+      return n_leafs_;
+    }
+
+    // input indices of the particles of a leaf (NULL unless SPH_TRACK_IDS)
+    const int* leaf_ids(const ParticleTreeNode* leaf) const {
+      return ids_i_ ? ids_i_ + (leaf->particles_i - particles_i_) : NULL;
+    }
+
+    // deterministic reductions (see parallel_reduce)
+    template <typename T, typename Func, typename Combine>
+    inline T reduce_leaf(const T init, const Func body, const Combine combine) const {
+      return parallel_reduce(0, n_leafs_, init, [&] (int idx) {
+        return body(static_cast<const ParticleTreeNode*>(leaf_array_[idx]));
+      }, combine);
+    }
+
+    template <typename T, typename Func, typename Combine>
+    inline T reduce_particle(const T init, const Func body, const Combine combine) {
+      return parallel_reduce(0, n_particles_, init, [&] (int i) {
+        return body(particles_i_[i]);
+      }, combine);
+    }
+
+    // body may update the particle, as in pfor_fluid_particle
+    template <typename T, typename Func, typename Combine>
+    inline T reduce_fluid_particle(const T init, const Func body, const Combine combine) {
+      return parallel_reduce(0, n_fluid_leafs_, init, [&] (int idx) {
+        ParticleTreeNode* leaf = leaf_array_[idx];
+        T acc = init;
+        for (int i = 0; i < leaf->n_fluid; i++) {
+          acc = combine(acc, body(leaf->particles_i[i]));
+        }
+        return acc;
+      }, combine);
+    }
+
+    template <typename Func>
+    inline void for_neighbor(const ParticleTreeNode* leaf, const Func body) const {
+      for (int k = nb_offsets_[leaf->index]; k < nb_offsets_[leaf->index + 1]; k++) {
+        body(leaf_array_[nb_indices_[k]]);
+      }
     }
 
     template <typename Func>
     inline void for_leaf(const Func body) {
-      for_leaf_impl(root_, body);
+      if (root_)      for_leaf_impl(root_, body);
+      if (wall_root_) for_leaf_impl(wall_root_, body);
     }
 
-#if SPH_LOOP_PARALLEL || SPH_CUDA_PARALLEL
+#if SPH_HOST_PARALLEL || SPH_CUDA_PARALLEL
     void setup_global_array();
-    void destroy_global_array();
 #endif
 
     friend std::ostream& operator << (std::ostream& c, const ParticleTree& tree) {
-      for_leaf_impl(tree.root_, [&] (ParticleTreeNode* leaf) {
+      auto print_leaf = [&] (ParticleTreeNode* leaf) {
 #if SPH_RECORD_CPU
-        c << leaf->cpu << " " << leaf->bbox << " " << leaf->n_particles << std::endl;
+        // the node the leaf was computed on and the node its particles reside on
+        c << leaf->cpu << " " << leaf->bbox << " " << leaf->n_particles << " "
+          << leaf->node << " " << numa_memory_node(leaf->particles_i) << std::endl;
 #else
         c << "-1 " << leaf->bbox << " " << leaf->n_particles << std::endl;
 #endif
-      });
+      };
+      if (tree.root_)      for_leaf_impl(tree.root_, print_leaf);
+      if (tree.wall_root_) for_leaf_impl(tree.wall_root_, print_leaf);
       return c;
     }
 };
@@ -0,0 +1,291 @@
+#include <cmath>
+#include <cstdio>
+
+#include "render.hpp"
+#include "trace.hpp"
+#include "util.hpp"
+
+typedef struct {
+  uint8_t r, g, b;
+} Color;
+
+static const Color BACKGROUND  = {255, 255, 255};
+static const Color FLUID_COLOR = {0x2d, 0x5a, 0xe0}; // as plot_2d_animation.bash
+static const Color WALL_COLOR  = {0x33, 0x33, 0x33};
+static const Color NO_CPU      = {0x99, 0x99, 0x99};
+
+// rows per parallel band
+constexpr int BAND_ROWS = 16;
+
+// viridis, sampled at 9 points
+static const Color VIRIDIS[] = {
+  {0x44, 0x01, 0x54}, {0x47, 0x2d, 0x7b}, {0x3b, 0x52, 0x8b},
+  {0x2c, 0x72, 0x8e}, {0x21, 0x91, 0x8c}, {0x28, 0xae, 0x80},
+  {0x5e, 0xc9, 0x62}, {0xad, 0xdc, 0x30}, {0xfd, 0xe7, 0x25},
+};
+
+// categorical colors for CPUs (tab10)
+static const Color CATEGORY[] = {
+  {0x1f, 0x77, 0xb4}, {0xff, 0x7f, 0x0e}, {0x2c, 0xa0, 0x2c}, {0xd6, 0x27, 0x28},
+  {0x94, 0x67, 0xbd}, {0x8c, 0x56, 0x4b}, {0xe3, 0x77, 0xc2}, {0x7f, 0x7f, 0x7f},
+  {0xbc, 0xbd, 0x22}, {0x17, 0xbe, 0xcf},
+};
+
+// v in [0, 1]
+inline Color viridis(const real v) {
+  constexpr int n = sizeof(VIRIDIS) / sizeof(VIRIDIS[0]) - 1;
+  const real t = min_(max_(v, real(0)), real(1)) * n;
+  const int  k = min_((int)t, n - 1);
+  const real f = t - k;
+  const Color& a = VIRIDIS[k];
+  const Color& b = VIRIDIS[k + 1];
+  Color c = {(uint8_t)(a.r + f * (b.r - a.r)),
+             (uint8_t)(a.g + f * (b.g - a.g)),
+             (uint8_t)(a.b + f * (b.b - a.b))};
+  return c;
+}
+
+inline Color cpu_color(const int cpu) {
+  if (cpu < 0) return NO_CPU;
+  return CATEGORY[cpu % (sizeof(CATEGORY) / sizeof(CATEGORY[0]))];
+}
+
+// sqrt(2 g H) for the fluid block of scenario.hpp (H = 0.55)
+constexpr real RENDER_VMAX = 3.3;
+
+inline Color particle_color(const Particle& p, const ParticleTreeNode* leaf) {
+#if SPH_RENDER_COLOR == 3
+#if SPH_RECORD_CPU
+  return cpu_color(leaf->cpu);
+#else
+  return cpu_color(-1);
+#endif
+#else
+  if (p.type == WALL) return WALL_COLOR;
+#if SPH_RENDER_COLOR == 1
+  // density deviation within +-2 %
+  return viridis((p.dens / DENS0 - 1) * 25 + 0.5);
+#elif SPH_RENDER_COLOR == 2
+  return viridis(sqrt(p.vel * p.vel) / RENDER_VMAX);
+#else
+  return FLUID_COLOR;
+#endif
+#endif
+}
+
+// the plane shown
+inline real screen_x(const realvec& v) {
+  return v.x;
+}
+
+inline real screen_y(const realvec& v) {
+#if SPH_2D
+  return v.y;
+#else
+  return v.z;
+#endif
+}
+
+FrameRenderer::FrameRenderer(const int width)
+  : width_(width), height_(0), scale_(0), x0_(0), y0_(0) {}
+
+void FrameRenderer::fit(const std::vector<const ParticleTreeNode*>& leafs) {
+  real xmin = INFINITY, xmax = -INFINITY, ymin = INFINITY, ymax = -INFINITY;
+  for (const ParticleTreeNode* leaf : leafs) {
+    xmin = min_(xmin, screen_x(leaf->inner_bbox.min));
+    xmax = max_(xmax, screen_x(leaf->inner_bbox.max));
+    ymin = min_(ymin, screen_y(leaf->inner_bbox.min));
+    ymax = max_(ymax, screen_y(leaf->inner_bbox.max));
+  }
+  // a margin of a few particles
+  const real margin = 2 * L0;
+  xmin -= margin; xmax += margin;
+  ymin -= margin; ymax += margin;
+  scale_  = (width_ - 1) / (xmax - xmin);
+  height_ = (int)std::ceil((ymax - ymin) * scale_) + 1;
+  x0_     = xmin;
+  y0_     = ymax;
+  pixels_.resize((size_t)width_ * height_ * 3);
+}
+
+void FrameRenderer::render(ParticleTree& ptree) {
+  TRACE_SCOPE("render");
+  std::vector<const ParticleTreeNode*> leafs;
+  ptree.for_leaf([&] (ParticleTreeNode* leaf) {
+    leafs.push_back(leaf);
+  });
+  if (height_ == 0) fit(leafs);
+
+  // discs of a particle spacing; particles may have drifted from the leaf
+  // boxes by up to the skin since the last refit
+  const int  radius = (int)(0.5 * L0 * scale_);
+  const real reach  = SKIN + (radius + 1) / scale_;
+  const int  n_bands = (height_ + BAND_ROWS - 1) / BAND_ROWS;
+
+  parallel_for(0, n_bands, [&] (int band) {
+    const int row_begin = band * BAND_ROWS;
+    const int row_end   = min_(row_begin + BAND_ROWS, height_);
+    uint8_t* rows = &pixels_[(size_t)row_begin * width_ * 3];
+    for (size_t i = 0; i < (size_t)(row_end - row_begin) * width_; i++) {
+      rows[3 * i]     = BACKGROUND.r;
+      rows[3 * i + 1] = BACKGROUND.g;
+      rows[3 * i + 2] = BACKGROUND.b;
+    }
+    auto plot = [&] (const int px, const int py, const Color& c) {
+      if (px < 0 || px >= width_ || py < row_begin || py >= row_end) return;
+      uint8_t* q = &pixels_[((size_t)py * width_ + px) * 3];
+      q[0] = c.r;
+      q[1] = c.g;
+      q[2] = c.b;
+    };
+    // world y of the band, top row first
+    const real band_top    = y0_ - row_begin / scale_;
+    const real band_bottom = y0_ - row_end / scale_;
+
+    for (const ParticleTreeNode* leaf : leafs) {
+      if (screen_y(leaf->inner_bbox.min) - reach > band_top ||
+          screen_y(leaf->inner_bbox.max) + reach < band_bottom) continue;
+      for (int i = 0; i < leaf->n_particles; i++) {
+        const Particle& p = leaf->particles_i[i];
+        const int cx = (int)std::lround((screen_x(p.pos) - x0_) * scale_);
+        const int cy = (int)std::lround((y0_ - screen_y(p.pos)) * scale_);
+        if (cy + radius < row_begin || cy - radius >= row_end) continue;
+        const Color c = particle_color(p, leaf);
+        for (int dy = -radius; dy <= radius; dy++) {
+          for (int dx = -radius; dx <= radius; dx++) {
+            if (dx * dx + dy * dy <= radius * radius + radius) plot(cx + dx, cy + dy, c);
+          }
+        }
+      }
+    }
+
+#if SPH_RENDER_LEAVES
+    for (const ParticleTreeNode* leaf : leafs) {
+      const int x0 = (int)std::lround((screen_x(leaf->bbox.min) - x0_) * scale_);
+      const int x1 = (int)std::lround((screen_x(leaf->bbox.max) - x0_) * scale_);
+      const int y0 = (int)std::lround((y0_ - screen_y(leaf->bbox.max)) * scale_);
+      const int y1 = (int)std::lround((y0_ - screen_y(leaf->bbox.min)) * scale_);
+      if (y1 < row_begin || y0 >= row_end) continue;
+#if SPH_RECORD_CPU
+      const Color c = cpu_color(leaf->cpu);
+#else
+      const Color c = WALL_COLOR;
+#endif
+      for (int x = x0; x <= x1; x++) {
+        plot(x, y0, c);
+        plot(x, y1, c);
+      }
+      for (int y = max_(y0, row_begin); y <= min_(y1, row_end - 1); y++) {
+        plot(x0, y, c);
+        plot(x1, y, c);
+      }
+    }
+#endif
+  });
+}
+
+// PNG with the image data in stored (uncompressed) deflate blocks: frames
+// are written at simulation speed, and compress well in a video anyway
+typedef struct CrcTable {
+  uint32_t t[256];
+
+  CrcTable() {
+    for (uint32_t n = 0; n < 256; n++) {
+      uint32_t c = n;
+      for (int k = 0; k < 8; k++) c = (c & 1) ? 0xedb88320u ^ (c >> 1) : c >> 1;
+      t[n] = c;
+    }
+  }
+} CrcTable;
+
+static uint32_t crc32(const uint8_t* buf, const size_t len) {
+  static const CrcTable table;
+  uint32_t crc = 0xffffffffu;
+  for (size_t i = 0; i < len; i++) crc = table.t[(crc ^ buf[i]) & 0xff] ^ (crc >> 8);
+  return crc ^ 0xffffffffu;
+}
+
+static void put_u32(std::vector<uint8_t>& out, const uint32_t v) {
+  out.push_back(v >> 24);
+  out.push_back(v >> 16);
+  out.push_back(v >> 8);
+  out.push_back(v);
+}
+
+static void write_chunk(FILE* fp, const char* type, const std::vector<uint8_t>& data) {
+  std::vector<uint8_t> chunk;
+  put_u32(chunk, data.size());
+  chunk.insert(chunk.end(), type, type + 4);
+  chunk.insert(chunk.end(), data.begin(), data.end());
+  put_u32(chunk, crc32(&chunk[4], chunk.size() - 4));
+  fwrite(chunk.data(), 1, chunk.size(), fp);
+}
+
+static void write_png(FILE* fp, const int width, const int height, const uint8_t* pixels) {
+  static const uint8_t signature[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'};
+  fwrite(signature, 1, 8, fp);
+
+  std::vector<uint8_t> ihdr;
+  put_u32(ihdr, width);
+  put_u32(ihdr, height);
+  ihdr.push_back(8); // bit depth
+  ihdr.push_back(2); // RGB
+  ihdr.push_back(0); // deflate
+  ihdr.push_back(0); // adaptive filtering
+  ihdr.push_back(0); // no interlace
+  write_chunk(fp, "IHDR", ihdr);
+
+  // scanlines with filter type 0
+  const size_t stride = (size_t)width * 3;
+  std::vector<uint8_t> raw;
+  raw.reserve((stride + 1) * height);
+  for (int y = 0; y < height; y++) {
+    raw.push_back(0);
+    raw.insert(raw.end(), pixels + y * stride, pixels + (y + 1) * stride);
+  }
+
+  // zlib stream of stored blocks
+  std::vector<uint8_t> idat;
+  idat.push_back(0x78);
+  idat.push_back(0x01);
+  size_t pos = 0;
+  do {
+    const size_t len = min_(raw.size() - pos, (size_t)65535);
+    idat.push_back(pos + len == raw.size()); // last block
+    idat.push_back(len & 0xff);
+    idat.push_back(len >> 8);
+    idat.push_back(~len & 0xff);
+    idat.push_back((~len >> 8) & 0xff);
+    idat.insert(idat.end(), raw.begin() + pos, raw.begin() + pos + len);
+    pos += len;
+  } while (pos < raw.size());
+  // Adler-32 of the uncompressed data
+  uint32_t a = 1, b = 0;
+  for (uint8_t v : raw) {
+    a = (a + v) % 65521;
+    b = (b + a) % 65521;
+  }
+  put_u32(idat, (b << 16) | a);
+  write_chunk(fp, "IDAT", idat);
+  write_chunk(fp, "IEND", std::vector<uint8_t>());
+}
+
+void FrameRenderer::write(const char* filename) const {
+  TRACE_SCOPE("write_frame");
+  FILE* fp = fopen(filename, "wb");
+  if (!fp) {
+    perror(filename);
+    return;
+  }
+#if SPH_RENDER_FORMAT == 1
+  write_png(fp, width_, height_, pixels_.data());
+#else
+  fprintf(fp, "P6\n%d %d\n255\n", width_, height_);
+  fwrite(pixels_.data(), 1, pixels_.size(), fp);
+#endif
+  fclose(fp);
+}
+
+const char* FrameRenderer::extension() {
+  return SPH_RENDER_FORMAT == 1 ? "png" : "ppm";
+}
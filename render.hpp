@@ -0,0 +1,46 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include "config.hpp"
+#include "defs.hpp"
+#include "particle_tree.hpp"
+
+/*
+ * In-situ renderer (SPH_RENDER_INTERVAL): frames drawn straight from the
+ * particle arrays instead of plotting text dumps afterwards.
+ *
+ * Particles are splatted as discs of about one particle spacing, colored by
+ * SPH_RENDER_COLOR, and with SPH_RENDER_LEAVES the outlines of the leaf boxes
+ * are drawn on top (colored by the CPU that computed the leaf if
+ * SPH_RECORD_CPU is set). 3D runs are shown from the side (x-z plane). The
+ * view is fitted to the particles of the first frame and kept, so that the
+ * frames of a run line up.
+ *
+ * The image is rendered in parallel over bands of rows; every band only
+ * visits the leaves overlapping it and only writes its own rows.
+ */
+
+class FrameRenderer {
+  private:
+    int                  width_;
+    int                  height_;
+    real                 scale_;   // pixels per unit length
+    real                 x0_;      // world coordinates of the top left pixel
+    real                 y0_;
+    std::vector<uint8_t> pixels_;  // RGB, top row first
+
+    void fit(const std::vector<const ParticleTreeNode*>& leafs);
+
+  public:
+    FrameRenderer(const int width);
+
+    void render(ParticleTree& ptree);
+
+    // binary PPM (SPH_RENDER_FORMAT 0) or PNG (1)
+    void write(const char* filename) const;
+
+    // file extension of the frames
+    static const char* extension();
+};
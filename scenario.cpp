@@ -0,0 +1,122 @@
+#include <fstream>
+#include <limits>
+
+#include "scenario.hpp"
+#include "trace.hpp"
+#include "util.hpp"
+
+// a lattice [lo, hi) of particles of one type
+typedef struct {
+  int           lo[3];
+  int           hi[3];
+  particle_type type;
+} Block;
+
+inline long block_size(const Block& b) {
+  long n = 1;
+  for (int d = 0; d < DIM; d++) n *= b.hi[d] - b.lo[d];
+  return n;
+}
+
+DamBreak dam_break() {
+  DamBreak s;
+  s.n_wall       = 2;
+  s.box_offset_x = 130;
+  return s;
+}
+
+static std::vector<Block> dam_break_blocks(const DamBreak& s) {
+  constexpr int sc = SPH_DATA_SCALE;
+  const int nw = s.n_wall;
+  const int bo = s.box_offset_x * sc;
+  std::vector<Block> blocks;
+#if SPH_2D
+  const int fx = 67 * sc, fy = 30 * sc;
+  const int wx = 175 * sc, wy = 55 * sc;
+  const int bx = 10 * sc, by = 9 * sc;
+
+  blocks.push_back({{0,   0  }, {fx,      fy}, FLUID});
+  // bottom wall
+  blocks.push_back({{-nw, -nw}, {wx + nw, 0 }, WALL});
+  // side walls
+  blocks.push_back({{-nw, 0  }, {0,       wy}, WALL});
+  blocks.push_back({{wx,  0  }, {wx + nw, wy}, WALL});
+  // box
+  blocks.push_back({{bo,  0  }, {bo + bx, by}, WALL});
+#else
+  const int fx = 67 * sc, fy = 54 * sc, fz = 30 * sc;
+  const int wx = 175 * sc, wy = 54 * sc, wz = 55 * sc;
+  const int bx = 10 * sc, by = 20 * sc, bz = 9 * sc;
+
+  blocks.push_back({{0,   0,   0  }, {fx,      fy,      fz}, FLUID});
+  // bottom wall
+  blocks.push_back({{-nw, -nw, -nw}, {wx + nw, wy + nw, 0 }, WALL});
+  // xz walls
+  blocks.push_back({{-nw, -nw, 0  }, {wx + nw, 0,       wz}, WALL});
+  blocks.push_back({{-nw, wy,  0  }, {wx + nw, wy + nw, wz}, WALL});
+  // yz walls
+  blocks.push_back({{-nw, 0,   0  }, {0,       wy,      wz}, WALL});
+  blocks.push_back({{wx,  0,   0  }, {wx + nw, wy,      wz}, WALL});
+  // box
+  blocks.push_back({{bo, wy / 2 - by / 2, 0}, {bo + bx, wy / 2 + by / 2, bz}, WALL});
+#endif
+  return blocks;
+}
+
+BoundingBox obstacle(const DamBreak& s) {
+  constexpr int sc = SPH_DATA_SCALE;
+  const int bo = s.box_offset_x * sc;
+#if SPH_2D
+  return BoundingBox(realvec(bo * L0 + 0.5 * L0, 0.5 * L0),
+                     realvec((bo + 10 * sc) * L0 + 0.5 * L0, 9 * sc * L0 + 0.5 * L0));
+#else
+  return BoundingBox(realvec(bo * L0 + 0.5 * L0, 17 * sc * L0 + 0.5 * L0, 0.5 * L0),
+                     realvec((bo + 10 * sc) * L0 + 0.5 * L0, 37 * sc * L0 + 0.5 * L0, 9 * sc * L0 + 0.5 * L0));
+#endif
+}
+
+void generate_dam_break(const DamBreak& scenario, std::vector<Particle>& particles) {
+  TRACE_SCOPE("generate");
+  // the spacing of the scripts, in double precision as they compute it
+  const double l0 = 0.55 / 30.0 / SPH_DATA_SCALE;
+  const std::vector<Block> blocks = dam_break_blocks(scenario);
+  std::vector<long> offsets(blocks.size() + 1, 0);
+  for (size_t b = 0; b < blocks.size(); b++) {
+    offsets[b + 1] = offsets[b] + block_size(blocks[b]);
+  }
+
+  const size_t base = particles.size();
+  particles.resize(base + offsets.back());
+  Particle* ps = particles.data() + base;
+
+  // one iteration per x layer of every block
+  std::vector<int> layers(1, 0);
+  for (const Block& b : blocks) {
+    layers.push_back(layers.back() + b.hi[0] - b.lo[0]);
+  }
+  parallel_for(0, layers.back(), [&] (int l) {
+    int b = 0;
+    while (layers[b + 1] <= l) b++;
+    const Block& blk = blocks[b];
+    const int x = blk.lo[0] + l - layers[b];
+    long i = offsets[b] + (long)(l - layers[b]) * (block_size(blk) / (blk.hi[0] - blk.lo[0]));
+    for (int y = blk.lo[1]; y < blk.hi[1]; y++) {
+#if SPH_2D
+      ps[i++] = make_particle(realvec((x + 1) * l0, (y + 1) * l0), blk.type);
+#else
+      for (int z = blk.lo[2]; z < blk.hi[2]; z++) {
+        ps[i++] = make_particle(realvec((x + 1) * l0, (y + 1) * l0, (z + 1) * l0), blk.type);
+      }
+#endif
+    }
+  });
+}
+
+void export_particles(const std::vector<Particle>& particles, const char* filename) {
+  TRACE_SCOPE("export");
+  std::ofstream ofs(filename);
+  ofs.precision(std::numeric_limits<real>::max_digits10);
+  for (const Particle& p : particles) {
+    ofs << p.pos << " " << p.type << "\n";
+  }
+}
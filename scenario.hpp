@@ -0,0 +1,61 @@
+#pragma once
+
+#include <vector>
+
+#include "config.hpp"
+#include "defs.hpp"
+#include "kernel.hpp"
+
+/*
+ * Native generation of the dam break of scripts/gen_data_{2,3}d.py
+ * (SPH_SCENARIO), written in parallel straight into the particle array.
+ *
+ * Particles come out in the same order and at the same positions as from the
+ * scripts: the fluid block, the walls and the box obstacle, each a lattice of
+ * spacing L0 iterated x outermost. Sizes are given in particles at scale 1
+ * and multiplied by SPH_DATA_SCALE.
+ */
+
+typedef struct {
+  int n_wall;        // layers of wall particles
+  int box_offset_x;  // of the obstacle
+} DamBreak;
+
+// the geometry of the scripts at SPH_DATA_SCALE
+DamBreak dam_break();
+
+void generate_dam_break(const DamBreak& scenario, std::vector<Particle>& particles);
+
+// the obstacle, padded by half a particle spacing
+BoundingBox obstacle(const DamBreak& scenario);
+
+// write particles in the format of scripts/gen_data_*.py
+void export_particles(const std::vector<Particle>& particles, const char* filename);
+
+// a particle at rest
+inline Particle make_particle(const realvec& pos, const particle_type type) {
+  Particle p;
+  p.pos  = pos;
+  p.type = type;
+#if SPH_2D
+  p.mass = DENS0 * pow(L0, 2);
+#else
+  p.mass = DENS0 * pow(L0, 3);
+#endif
+  p.vel  = 0;
+  p.acc  = 0;
+  p.vel_half = 0;
+  p.dens = DENS0;
+  p.pres = calc_pressure(DENS0);
+#if SPH_DENSITY_FILTER
+  p.dens_filt = DENS0;
+#endif
+#if SPH_CFL_DT
+  p.f    = 0;
+#endif
+#if SPH_BLOCK_DT
+  p.rung   = 0;
+  p.active = true;
+#endif
+  return p;
+}
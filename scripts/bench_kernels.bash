@@ -0,0 +1,21 @@
+#!/bin/bash
+set -euo pipefail
+export LC_ALL=C
+export LANG=C
+
+SCALE=1
+MAX_STEP=1000
+
+# export SPH_LOOP_PARALLEL=1
+
+cd $(dirname $0)/..
+
+mkdir -p data result
+[ -f data/data2d.txt ] || ./scripts/gen_data_2d.py $SCALE > data/data2d.txt
+
+for KERNEL in SPH_CUBIC_SPLINE SPH_WENDLAND_C2 SPH_WENDLAND_C4; do
+  make clean > /dev/null
+  CFLAGS="-DSPH_2D=1 -DSPH_DATA_SCALE=$SCALE -DSPH_MAX_STEP=$MAX_STEP -DSPH_SMOOTHING_KERNEL=$KERNEL" make -j > /dev/null
+  echo "## $KERNEL"
+  ./sph.out | grep -E "^(neighbors|time per step)"
+done
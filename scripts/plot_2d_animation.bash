@@ -6,6 +6,13 @@ export LANG=C
 OUTPUT="2d_animation.gif"
 
 cd $(dirname $0)/../result
+
+# binary snapshots (SPH_OUTPUT_BINARY)
+for f in dambreaking2d.snap.*; do
+  [ -e "$f" ] || continue
+  ../scripts/snapshot_to_txt.py "$f" > "${f/snap/txt}"
+done
+
 N=$(ls | sed 's/dambreaking2d\.txt\.\([0-9]*\)$/\1/g' | sort -n | tail -n 1)
 
 echo "
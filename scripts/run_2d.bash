@@ -10,19 +10,17 @@ SCALE=8
 OUTPUT_INTERVAL=0
 MAX_STEP=100
 RECORD_CPU=1
+# generate the particles in the simulator instead of data/data2d.txt
+SCENARIO=1
 
 # export SPH_LOOP_PARALLEL=1
 export SPH_CUDA_PARALLEL=1
 
 cd $(dirname $0)/..
 
-echo "## Generating data..."
-mkdir -p data
-./scripts/gen_data_2d.py $SCALE > data/data2d.txt
-
 echo "## Building..."
 make clean
-CFLAGS="-DSPH_2D=$SPH_2D -DSPH_DOUBLE=$DOUBLE -DSPH_REUSE_TREE=$REUSE_TREE -DSPH_OUTPUT_INTERVAL=$OUTPUT_INTERVAL -DSPH_DATA_SCALE=$SCALE -DSPH_MAX_STEP=$MAX_STEP -DSPH_RECORD_CPU=$RECORD_CPU" make -j
+CFLAGS="-DSPH_2D=$SPH_2D -DSPH_DOUBLE=$DOUBLE -DSPH_REUSE_TREE=$REUSE_TREE -DSPH_OUTPUT_INTERVAL=$OUTPUT_INTERVAL -DSPH_DATA_SCALE=$SCALE -DSPH_MAX_STEP=$MAX_STEP -DSPH_RECORD_CPU=$RECORD_CPU -DSPH_SCENARIO=$SCENARIO" make -j
 
 echo "## Starting..."
 mkdir -p result
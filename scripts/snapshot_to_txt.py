@@ -0,0 +1,109 @@
+#!/usr/bin/env python3
+
+# Convert a binary snapshot (SPH_OUTPUT_BINARY, see snapshot.hpp) into the
+# text format of output_particles: one "x y [z] type" line per particle.
+# Snapshots with ids are written in the order of the input file.
+#
+# usage: snapshot_to_txt.py result/dambreaking2d.snap.N > dambreaking2d.txt.N
+
+import struct
+import sys
+
+FLUID = 1
+WALL  = 2
+
+class BitReader:
+    def __init__(self, buf, pos):
+        self.buf = buf
+        self.pos = pos
+        self.bit = 0
+
+    def get(self):
+        b = (self.buf[self.pos] >> self.bit) & 1
+        self.bit += 1
+        if self.bit == 8:
+            self.bit = 0
+            self.pos += 1
+        return b
+
+    def get_bits(self, n):
+        v = 0
+        for i in range(n):
+            v |= self.get() << i
+        return v
+
+    def get_rice(self, k):
+        q = 0
+        while self.get():
+            q += 1
+        return (q << k) | self.get_bits(k)
+
+    def finish(self):
+        return self.pos + (1 if self.bit else 0)
+
+def read_varint(buf, pos):
+    v = 0
+    shift = 0
+    while True:
+        b = buf[pos]
+        pos += 1
+        v |= (b & 0x7f) << shift
+        if b < 0x80:
+            return v, pos
+        shift += 7
+
+def unzigzag(v):
+    return (v >> 1) ^ -(v & 1)
+
+def deinterleave(key, dim, bits):
+    q = [0] * dim
+    for b in range(bits):
+        for d in range(dim):
+            q[d] |= ((key >> (b * dim + d)) & 1) << b
+    return q
+
+def read_snapshot(filename):
+    with open(filename, 'rb') as f:
+        buf = f.read()
+
+    magic, version, dim, bits, flags, n_particles, n_leaves = struct.unpack_from('<4sBBBBII', buf, 0)
+    if magic != b'SPHS' or version != 1:
+        sys.exit('%s: not a version 1 snapshot' % filename)
+    has_ids = flags & 1
+    q_max = (1 << bits) - 1
+    pos = 16
+
+    particles = []
+    pid = 0
+    for _ in range(n_leaves):
+        bounds = struct.unpack_from('<%df' % (2 * dim), buf, pos)
+        pos += 8 * dim
+        lo = bounds[:dim]
+        hi = bounds[dim:]
+        n, pos = read_varint(buf, pos)
+        n_fluid, pos = read_varint(buf, pos)
+        k_key, k_id = buf[pos], buf[pos + 1]
+        pos += 2
+
+        reader = BitReader(buf, pos)
+        key = 0
+        pid = 0
+        for i in range(n):
+            if i == 0 or i == n_fluid:
+                key = 0
+            key += reader.get_rice(k_key)
+            if has_ids:
+                pid += unzigzag(reader.get_rice(k_id))
+            q = deinterleave(key, dim, bits)
+            x = [lo[d] + (hi[d] - lo[d]) * q[d] / q_max for d in range(dim)]
+            particles.append((pid, x, FLUID if i < n_fluid else WALL))
+        pos = reader.finish()
+
+    if len(particles) != n_particles:
+        sys.exit('%s: expected %d particles, found %d' % (filename, n_particles, len(particles)))
+    if has_ids:
+        particles.sort(key=lambda p: p[0])
+    return particles
+
+for pid, x, t in read_snapshot(sys.argv[1]):
+    print(' '.join('%g' % v for v in x), t)
@@ -0,0 +1,117 @@
+#pragma once
+
+#include <cmath>
+
+#include "config.hpp"
+
+/*
+ * Smoothing kernels, selected by SPH_SMOOTHING_KERNEL at compile time.
+ *
+ * Every kernel vanishes beyond its support radius slen, which is SUPPORT
+ * times the particle spacing unless SPH_KERNEL_SUPPORT is given (see SLEN in
+ * defs.hpp). The Wendland kernels overestimate the density of a lattice at
+ * short supports (by 3.8% at 2.0 L0 in 2D, against 0.2% for the cubic
+ * spline at 2.1 L0), so they use a wider support by default, with a bias of
+ * about 0.6%.
+ *
+ * W(dr, dr2, slen) and gradW(dr, dr2, slen) take the distance vector and its
+ * square, and are only called for dr2 < slen^2.
+ */
+
+// M4 cubic spline with h = slen / 2
+struct CubicSpline {
+  static constexpr double SUPPORT = 2.1;
+
+  template <int D, typename T, typename V>
+  SPH_KERNEL
+  static inline T W(const V& dr, const T dr2, const T slen) {
+    const T H = slen / 2.0;
+    const T COEF = (D == 2) ? T(10.0 / 7.0 / M_PI / (H * H)) : T(1.0 / M_PI / (H * H * H));
+    const T s = sqrt(dr2) / H;
+    T v = 0;
+    if (s < 1.0) {
+      v = 1.0 - 1.5 * pow(s, 2) + 0.75 * pow(s, 3);
+    } else if (s < 2.0) {
+      v = 0.25 * pow(2.0 - s, 3);
+    }
+    return COEF * v;
+  }
+
+  template <int D, typename T, typename V>
+  SPH_KERNEL
+  static inline V gradW(const V& dr, const T dr2, const T slen) {
+    const T H = slen / 2.0;
+    const T COEF = (D == 2) ? T(45.0 / 14.0 / M_PI / (H * H * H * H))
+                            : T(2.25 / M_PI / (H * H * H * H * H));
+    const T s = sqrt(dr2) / H;
+    V v = 0;
+    if (s < 1.0) {
+      v = (s - 4.0 / 3.0) * dr;
+    } else if (s < 2.0) {
+      v = - pow(2.0 - s, 2) / 3.0 / s * dr;
+    }
+    return COEF * v;
+  }
+};
+
+// Wendland C2: (1 - q)^4 (1 + 4q) with q = r / slen
+struct WendlandC2 {
+  static constexpr double SUPPORT = 2.8;
+
+  template <int D, typename T, typename V>
+  SPH_KERNEL
+  static inline T W(const V& dr, const T dr2, const T slen) {
+    const T COEF = (D == 2) ? T(7.0 / M_PI / (slen * slen))
+                            : T(21.0 / 2.0 / M_PI / (slen * slen * slen));
+    const T q = sqrt(dr2) / slen;
+    const T t = 1.0 - q;
+    return COEF * (t * t) * (t * t) * (1.0 + 4.0 * q);
+  }
+
+  template <int D, typename T, typename V>
+  SPH_KERNEL
+  static inline V gradW(const V& dr, const T dr2, const T slen) {
+    const T COEF = (D == 2) ? T(7.0 / M_PI / (slen * slen * slen * slen))
+                            : T(21.0 / 2.0 / M_PI / (slen * slen * slen * slen * slen));
+    const T q = sqrt(dr2) / slen;
+    const T t = 1.0 - q;
+    return (COEF * -20.0 * (t * t * t)) * dr;
+  }
+};
+
+// Wendland C4: (1 - q)^6 (1 + 6q + 35/3 q^2) with q = r / slen
+struct WendlandC4 {
+  static constexpr double SUPPORT = 2.8;
+
+  template <int D, typename T, typename V>
+  SPH_KERNEL
+  static inline T W(const V& dr, const T dr2, const T slen) {
+    const T COEF = (D == 2) ? T(9.0 / M_PI / (slen * slen))
+                            : T(495.0 / 32.0 / M_PI / (slen * slen * slen));
+    const T q = sqrt(dr2) / slen;
+    const T t = 1.0 - q;
+    const T t3 = t * t * t;
+    return COEF * (t3 * t3) * (1.0 + 6.0 * q + 35.0 / 3.0 * q * q);
+  }
+
+  template <int D, typename T, typename V>
+  SPH_KERNEL
+  static inline V gradW(const V& dr, const T dr2, const T slen) {
+    const T COEF = (D == 2) ? T(9.0 / M_PI / (slen * slen * slen * slen))
+                            : T(495.0 / 32.0 / M_PI / (slen * slen * slen * slen * slen));
+    const T q = sqrt(dr2) / slen;
+    const T t = 1.0 - q;
+    const T t5 = t * t * t * t * t;
+    return (COEF * -56.0 / 3.0 * t5 * (1.0 + 5.0 * q)) * dr;
+  }
+};
+
+#if SPH_SMOOTHING_KERNEL == SPH_CUBIC_SPLINE
+typedef CubicSpline SmoothingKernel;
+#elif SPH_SMOOTHING_KERNEL == SPH_WENDLAND_C2
+typedef WendlandC2  SmoothingKernel;
+#elif SPH_SMOOTHING_KERNEL == SPH_WENDLAND_C4
+typedef WendlandC4  SmoothingKernel;
+#else
+# error "unknown SPH_SMOOTHING_KERNEL"
+#endif
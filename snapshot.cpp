@@ -0,0 +1,186 @@
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <fstream>
+#include <vector>
+
+#include "snapshot.hpp"
+#include "trace.hpp"
+
+constexpr uint8_t SNAPSHOT_VERSION = 1;
+constexpr uint8_t SNAPSHOT_IDS     = 1 << 0;
+
+typedef std::vector<uint8_t> ByteBuffer;
+
+inline void put_raw(ByteBuffer& buf, const void* data, const size_t len) {
+  const uint8_t* p = static_cast<const uint8_t*>(data);
+  buf.insert(buf.end(), p, p + len);
+}
+
+inline void put_varint(ByteBuffer& buf, uint32_t v) {
+  while (v >= 0x80) {
+    buf.push_back((uint8_t)(v | 0x80));
+    v >>= 7;
+  }
+  buf.push_back((uint8_t)v);
+}
+
+class BitWriter {
+  private:
+    ByteBuffer& buf_;
+    uint64_t    acc_;
+    int         n_bits_;
+
+    void flush_bytes() {
+      while (n_bits_ >= 8) {
+        buf_.push_back((uint8_t)acc_);
+        acc_ >>= 8;
+        n_bits_ -= 8;
+      }
+    }
+
+  public:
+    BitWriter(ByteBuffer& buf) : buf_(buf), acc_(0), n_bits_(0) {}
+
+    // n <= 32
+    void put(const uint64_t v, const int n) {
+      acc_ |= (v & ((1ULL << n) - 1)) << n_bits_;
+      n_bits_ += n;
+      flush_bytes();
+    }
+
+    // q ones and a zero, followed by the k low bits of v
+    void put_rice(const uint64_t v, const int k) {
+      uint64_t q = v >> k;
+      for (; q >= 32; q -= 32) put(0xffffffffULL, 32);
+      put((1ULL << q) - 1, q + 1);
+      for (int s = 0; s < k; s += 32) put(v >> s, std::min(32, k - s));
+    }
+
+    void finish() {
+      if (n_bits_ > 0) buf_.push_back((uint8_t)acc_);
+      acc_ = 0;
+      n_bits_ = 0;
+    }
+};
+
+template <typename T>
+inline void components(const realvec& v, T* c) {
+  c[0] = v.x;
+  c[1] = v.y;
+#if !SPH_2D
+  c[2] = v.z;
+#endif
+}
+
+inline uint64_t interleave(const uint32_t* q) {
+  uint64_t key = 0;
+  for (int b = 0; b < SPH_SNAPSHOT_BITS; b++) {
+    for (int d = 0; d < DIM; d++) {
+      key |= (uint64_t)((q[d] >> b) & 1) << (b * DIM + d);
+    }
+  }
+  return key;
+}
+
+inline uint32_t zigzag(const int32_t v) {
+  return ((uint32_t)v << 1) ^ (uint32_t)(v >> 31);
+}
+
+// Rice parameter for values with the given mean
+inline int rice_parameter(const double mean) {
+  return mean >= 2 ? (int)std::log2(mean) : 0;
+}
+
+typedef struct {
+  uint64_t key;
+  int      id;
+} SnapshotEntry;
+
+inline void encode_leaf(ByteBuffer& buf, const ParticleTreeNode* leaf, const int* ids) {
+  constexpr uint32_t Q_MAX = (1u << SPH_SNAPSHOT_BITS) - 1;
+  const Particle* ps = leaf->particles_i;
+  const int n = leaf->n_particles;
+
+  // particles may have drifted out of inner_bbox if the tree is reused
+  BoundingBox bbox(ps[0].pos);
+  for (int i = 1; i < n; i++) {
+    bbox.merge(ps[i].pos);
+  }
+  // the reader only sees the single precision bounds
+  float lo[DIM], hi[DIM];
+  components(bbox.min, lo);
+  components(bbox.max, hi);
+  real scale[DIM];
+  for (int d = 0; d < DIM; d++) {
+    scale[d] = (hi[d] > lo[d]) ? Q_MAX / ((real)hi[d] - (real)lo[d]) : 0;
+  }
+
+  std::vector<SnapshotEntry> entries(n);
+  for (int i = 0; i < n; i++) {
+    real pos[DIM];
+    uint32_t q[DIM];
+    components(ps[i].pos, pos);
+    for (int d = 0; d < DIM; d++) {
+      real t = std::round((pos[d] - lo[d]) * scale[d]);
+      q[d] = (uint32_t)min_(max_(t, real(0)), (real)Q_MAX);
+    }
+    entries[i].key = interleave(q);
+    entries[i].id  = ids ? ids[i] : 0;
+  }
+  auto by_key = [] (const SnapshotEntry& a, const SnapshotEntry& b) { return a.key < b.key; };
+  std::sort(entries.begin(), entries.begin() + leaf->n_fluid, by_key);
+  std::sort(entries.begin() + leaf->n_fluid, entries.end(), by_key);
+
+  std::vector<uint64_t> key_deltas(n);
+  std::vector<uint32_t> id_deltas(n);
+  double key_sum = 0, id_sum = 0;
+  for (int i = 0; i < n; i++) {
+    bool first = (i == 0 || i == leaf->n_fluid);
+    key_deltas[i] = entries[i].key - (first ? 0 : entries[i - 1].key);
+    id_deltas[i]  = zigzag(entries[i].id - (i == 0 ? 0 : entries[i - 1].id));
+    key_sum += key_deltas[i];
+    id_sum  += id_deltas[i];
+  }
+  const int k_key = rice_parameter(key_sum / n);
+  const int k_id  = rice_parameter(id_sum / n);
+
+  put_raw(buf, lo, sizeof(lo));
+  put_raw(buf, hi, sizeof(hi));
+  put_varint(buf, n);
+  put_varint(buf, leaf->n_fluid);
+  buf.push_back((uint8_t)k_key);
+  buf.push_back((uint8_t)k_id);
+  BitWriter bits(buf);
+  for (int i = 0; i < n; i++) {
+    bits.put_rice(key_deltas[i], k_key);
+    if (ids) bits.put_rice(id_deltas[i], k_id);
+  }
+  bits.finish();
+}
+
+void write_snapshot(ParticleTree& ptree, const char* filename) {
+  TRACE_SCOPE("output");
+  const int n_leafs = ptree.n_leafs();
+  std::vector<ByteBuffer> leaf_bufs(n_leafs);
+  int n_particles = 0;
+  ptree.for_leaf([&] (ParticleTreeNode* leaf) {
+    n_particles += leaf->n_particles;
+  });
+  ptree.pfor_leaf([&] (ParticleTreeNode* leaf) {
+    encode_leaf(leaf_bufs[leaf->index], leaf, ptree.leaf_ids(leaf));
+  });
+
+  ByteBuffer header;
+  const uint8_t info[8] = {'S', 'P', 'H', 'S', SNAPSHOT_VERSION, DIM, SPH_SNAPSHOT_BITS,
+                           (uint8_t)(SPH_TRACK_IDS ? SNAPSHOT_IDS : 0)};
+  const uint32_t counts[2] = {(uint32_t)n_particles, (uint32_t)n_leafs};
+  put_raw(header, info, sizeof(info));
+  put_raw(header, counts, sizeof(counts));
+
+  std::ofstream ofs(filename, std::ios::binary);
+  ofs.write(reinterpret_cast<const char*>(header.data()), header.size());
+  for (const auto& buf : leaf_bufs) {
+    ofs.write(reinterpret_cast<const char*>(buf.data()), buf.size());
+  }
+}
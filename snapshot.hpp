@@ -0,0 +1,30 @@
+#pragma once
+
+#include "config.hpp"
+#include "particle_tree.hpp"
+
+/*
+ * Compressed binary snapshot (SPH_OUTPUT_BINARY), read back by
+ * scripts/snapshot_to_txt.py. All integers are little endian.
+ *
+ *   header  char[4] "SPHS", u8 version, u8 dim, u8 bits, u8 flags,
+ *           u32 n_particles, u32 n_leaves
+ *   leaf    f32 min[dim], f32 max[dim], varint n, varint n_fluid,
+ *           u8 k_key, u8 k_id, bit stream padded to a byte
+ *
+ * Positions are quantized to SPH_SNAPSHOT_BITS bits per dimension within the
+ * bounding box of their leaf and interleaved into Morton keys. The fluid and
+ * the wall particles of a leaf are each sorted by key, and the differences
+ * between consecutive keys are Rice coded with parameter k_key (the first key
+ * of each run is coded as is). The bit stream is filled from the least
+ * significant bit of each byte.
+ *
+ * If flags bit 0 is set, every key is followed by the input index of the
+ * particle (SPH_TRACK_IDS), coded as the zigzag difference to the previous
+ * index with parameter k_id.
+ *
+ * The size is bounded by the entropy of the positions at the chosen
+ * precision: about DIM * SPH_SNAPSHOT_BITS - log2(n) + 2 bits per particle.
+ */
+
+void write_snapshot(ParticleTree& ptree, const char* filename);
@@ -1,14 +1,29 @@
+#include <algorithm>
+#include <atomic>
+#include <cmath>
 #include <cstdio>
 #include <iostream>
 #include <iomanip>
 #include <fstream>
+#include <map>
+#include <memory>
+#include <sstream>
+#include <string>
 #include <vector>
+#include <sys/stat.h>
 
 #include "config.hpp"
 #include "util.hpp"
 #include "defs.hpp"
 #include "particle_tree.hpp"
 #include "kernel.hpp"
+#include "metrics.hpp"
+#include "analysis.hpp"
+#include "snapshot.hpp"
+#include "scenario.hpp"
+#include "render.hpp"
+#include "trace.hpp"
+#include "tree_stats.hpp"
 
 void setup_particles(std::vector<Particle>& particles, const char* filename) {
   std::ifstream ifs(filename);
@@ -16,207 +31,779 @@ void setup_particles(std::vector<Particle>& particles, const char* filename) {
   int type;
 
   while (ifs >> pos >> type) {
-    Particle p;
-    p.pos  = pos;
-    p.type = (particle_type)type;
-#if SPH_2D
-    p.mass = DENS0 * pow(L0, 2);
-#else
-    p.mass = DENS0 * pow(L0, 3);
-#endif
-    p.vel  = 0;
-    p.acc  = 0;
-    p.dens = DENS0;
-    p.pres = calc_pressure(DENS0);
-    particles.push_back(p);
+    particles.push_back(make_particle(pos, (particle_type)type));
   }
 }
 
 void output_particles(ParticleTree& ptree, const char* filename) {
+  TRACE_SCOPE("output");
   std::ofstream ofs(filename);
 
+#if SPH_OUTPUT_IDS == 1
+  ptree.for_particle_by_id([&] (Particle& p, int id) {
+    ofs << p.pos << " " << p.type << std::endl;
+  });
+#elif SPH_OUTPUT_IDS == 2
+  ptree.for_particle_id([&] (Particle& p, int id) {
+    ofs << p.pos << " " << p.type << " " << id << std::endl;
+  });
+#else
   ptree.for_particle([&] (Particle& p) {
     ofs << p.pos << " " << p.type << std::endl;
   });
+#endif
 }
 
-inline double get_time_step(ParticleTree& ptree) {
-#if SPH_CFL_DT
-  real fmax = 0.0;
-  ptree.for_particle([&] (Particle& p) {
-    fmax = std::max(fmax, p.f);
+#if SPH_BLOCK_DT
+inline int rung_period(const int rung) {
+  return 1 << (SPH_MAX_RUNG - rung);
+}
+
+// dt_max is the step of rung 0 (DT for the default viscosity)
+inline double rung_dt(const int rung, const double dt_max) {
+  return dt_max / (1 << rung);
+}
+
+// smallest rung that is synchronized at the given tick
+inline int aligned_rung(const int tick) {
+  int rung = 0;
+  while (tick % rung_period(rung) != 0) rung++;
+  return rung;
+}
+
+// smallest rung whose step satisfies the particle's own CFL limit
+inline int get_rung(const Particle& p, const double dt_max) {
+  if (p.f == 0.0) return 0;
+  const double dt_cfl = 0.25 * SLEN / p.f;
+  int rung = 0;
+  while (rung < SPH_MAX_RUNG && rung_dt(rung, dt_max) > dt_cfl) rung++;
+  return rung;
+}
+
+void set_active(ParticleTree& ptree, const int tick) {
+  TRACE_SCOPE("set_active");
+  ptree.pfor_fluid_particle([&] (Particle& p) {
+    p.active = (tick % rung_period(p.rung) == 0);
   });
+  ptree.count_active();
+}
+
+// Put the particles that just finished their step onto new rungs and return
+// the number of ticks until the next rung becomes active.
+// A particle may only move to a coarser rung that is synchronized at this tick.
+inline int assign_rungs(ParticleTree& ptree, const int tick, const double dt_max, int& n_active) {
+  TRACE_SCOPE("assign_rungs");
+  typedef struct { int n_active; int max_rung; } RungCount;
+  const int min_rung = aligned_rung(tick);
+  const RungCount init = {0, 0};
+  RungCount count = ptree.reduce_fluid_particle(init, [&] (Particle& p) {
+    RungCount c = {0, 0};
+    if (p.active) {
+      p.rung = std::max(get_rung(p, dt_max), min_rung);
+      c.n_active = 1;
+    }
+    c.max_rung = p.rung;
+    return c;
+  }, [] (const RungCount& a, const RungCount& b) {
+    RungCount c = {a.n_active + b.n_active, std::max(a.max_rung, b.max_rung)};
+    return c;
+  });
+  n_active = count.n_active;
+  return rung_period(count.max_rung) - tick % rung_period(count.max_rung);
+}
+#endif
+
+inline double get_time_step(ParticleTree& ptree, const double dt_max) {
+  TRACE_SCOPE("time_step");
+#if SPH_CFL_DT
+  // walls are not given a force
+  real fmax = ptree.reduce_fluid_particle(real(0), [] (Particle& p) {
+    return p.f;
+  }, max_op());
   if (fmax == 0.0) {
-    return DT;
+    return dt_max;
   } else {
-    return std::min(0.25 * SLEN / fmax, DT);
+    return std::min(0.25 * SLEN / fmax, dt_max);
   }
 #else
-  return DT;
+  return dt_max;
 #endif
 }
 
-void initial_kick(ParticleTree& ptree, const double dt) {
-  ptree.pfor_particle([&] (Particle& p) {
-    if (p.type == FLUID) {
-      p.vel_half = p.vel + 0.5 * dt * p.acc;
+#if SPH_BLOCK_DT
+// only particles starting a new step are kicked, each with its own rung's step
+void initial_kick(ParticleTree& ptree, const double dt_max) {
+  TRACE_SCOPE("initial_kick");
+  ptree.pfor_fluid_particle([&] (Particle& p) {
+    if (p.active) {
+      p.vel_half = p.vel + 0.5 * rung_dt(p.rung, dt_max) * p.acc;
     }
   });
 }
+#else
+void initial_kick(ParticleTree& ptree, const double dt) {
+  TRACE_SCOPE("initial_kick");
+  ptree.pfor_fluid_particle([&] (Particle& p) {
+    p.vel_half = p.vel + 0.5 * dt * p.acc;
+  });
+}
+#endif
 
 #if SPH_REUSE_TREE
  bool full_drift(ParticleTree& ptree, const double dt) {
-  bool reuse = true;
+  TRACE_SCOPE("full_drift");
   // time becomes t + dt;
-  ptree.pfor_particle([&] (Particle& p) {
-    if (p.type == FLUID) {
-      p.pos += dt * p.vel_half;
-      // check whether we should reuse the list
-      realvec dp = p.pos - p.prev_pos;
-      if (sqrt(dp * dp) >= SKIN * 0.5) reuse = false;
-    }
-  });
-  return reuse;
+  return ptree.reduce_fluid_particle(true, [&] (Particle& p) {
+    p.pos += dt * p.vel_half;
+    // check whether we should reuse the list
+    realvec dp = p.pos - p.prev_pos;
+    return sqrt(dp * dp) < SKIN * 0.5;
+  }, and_op());
 }
 #else
 void full_drift(ParticleTree& ptree, const double dt) {
+  TRACE_SCOPE("full_drift");
   // time becomes t + dt;
-  ptree.pfor_particle([&] (Particle& p) {
-    if (p.type == FLUID) {
-      p.pos += dt * p.vel_half;
-    }
+  ptree.pfor_fluid_particle([&] (Particle& p) {
+    p.pos += dt * p.vel_half;
   });
 }
 #endif
 
-void final_kick(ParticleTree& ptree, const double dt) {
-  ptree.pfor_particle([&] (Particle& p) {
-    if (p.type == FLUID) {
-      p.vel = p.vel_half + 0.5 * dt * p.acc;
+#if SPH_BLOCK_DT
+void final_kick(ParticleTree& ptree, const double dt_max) {
+  TRACE_SCOPE("final_kick");
+  ptree.pfor_fluid_particle([&] (Particle& p) {
+    if (p.active) {
+      p.vel = p.vel_half + 0.5 * rung_dt(p.rung, dt_max) * p.acc;
     }
   });
 }
+#else
+void final_kick(ParticleTree& ptree, const double dt) {
+  TRACE_SCOPE("final_kick");
+  ptree.pfor_fluid_particle([&] (Particle& p) {
+    p.vel = p.vel_half + 0.5 * dt * p.acc;
+  });
+}
+#endif
+
+// the state of these steps is written out, so it must not be advanced early
+inline bool output_step(const int step) {
+#if SPH_OUTPUT_INTERVAL
+  if (step % SPH_OUTPUT_INTERVAL == 0) return true;
+#endif
+#if SPH_ANALYSIS_INTERVAL
+  if (step % SPH_ANALYSIS_INTERVAL == 0) return true;
+#endif
+#if SPH_RENDER_INTERVAL
+  if (step % SPH_RENDER_INTERVAL == 0) return true;
+#endif
+  return false;
+}
+
+#if SPH_FUSED_INTEGRATOR
+// Final kick of this step followed by the initial kick and the full drift of
+// the next one. Returns whether the tree can be reused for the next step.
+inline bool kick_drift(Particle& p, const double dt, const double dt_next) {
+  p.vel      = p.vel_half + 0.5 * dt * p.acc;
+  p.vel_half = p.vel + 0.5 * dt_next * p.acc;
+  p.pos     += dt_next * p.vel_half;
+#if SPH_REUSE_TREE
+  realvec dp = p.pos - p.prev_pos;
+  return sqrt(dp * dp) < SKIN * 0.5;
+#else
+  return true;
+#endif
+}
+
+bool kick_drift(ParticleTree& ptree, const double dt, const double dt_next) {
+  TRACE_SCOPE("kick_drift");
+  return ptree.reduce_fluid_particle(true, [&] (Particle& p) {
+    return kick_drift(p, dt, dt_next);
+  }, and_op());
+}
+
+#endif
+
+#if SPH_DENSITY_FILTER
+inline void apply_density_filter(Particle& p) {
+#if SPH_BLOCK_DT
+  if (!p.active) return;
+#endif
+  p.dens = p.dens_filt;
+  p.pres = calc_pressure(p.dens);
+}
+
+void apply_density_filter(ParticleTree& ptree) {
+  TRACE_SCOPE("density_filter");
+  ptree.pfor_fluid_particle([&] (Particle& p) {
+    apply_density_filter(p);
+  });
+}
+
+// Shepard steps also apply the diffusion
+inline bool shepard_step(const int step) {
+#if SPH_SHEPARD_INTERVAL
+  return step % SPH_SHEPARD_INTERVAL == 0;
+#else
+  return false;
+#endif
+}
+
+// The diffusion is integrated over the step that led to the current
+// densities: dt, or with SPH_BLOCK_DT the particle's rung of dt_max.
+inline DensFilterKernel density_filter(const int step, const double dt, const double dt_max) {
+#if SPH_BLOCK_DT
+  const DensFilterKernel filter = {(real)dt_max, shepard_step(step)};
+#else
+  const DensFilterKernel filter = {(real)dt, shepard_step(step)};
+#endif
+  return filter;
+}
+#endif
 
 #if SPH_REUSE_TREE
 void set_prev_pos(ParticleTree& ptree) {
-  ptree.pfor_particle([&] (Particle& p) {
+  TRACE_SCOPE("set_prev_pos");
+  // the first call comes before the fluid tree is built
+  ptree.pfor_fluid_array([&] (Particle& p) {
     p.prev_pos = p.pos;
   });
 }
 #endif
 
-int main(int argc, char* argv[]) {
-#if PARTICLE_SIMULATOR_TASK_PARALLEL
-#if DISABLE_STEAL
-  myth_adws_set_stealable(0);
-#endif
+// The fluid tree is rebuilt every SPH_REBUILD_INTERVAL updates and only
+// refitted in between; the wall tree is never rebuilt.
+void update_tree(ParticleTree& ptree, const int count) {
+  TRACE_SCOPE("update_tree");
+  if (count % SPH_REBUILD_INTERVAL == 0) {
+    ptree.build();
+  } else {
+    ptree.refit();
+  }
+}
+
+#if SPH_DATAFLOW
+enum {
+  STAGE_DENS,
+  STAGE_FILTER,
+  STAGE_APPLY_FILTER,
+  STAGE_HYDRO,
+  STAGE_KICK_DRIFT,
+};
+
+// The interactions of a step, and the fused kick-drift into the next one if
+// kick is set, as a per-leaf task graph. dt is the step that led to this
+// state. Returns whether the tree can be reused after the kick-drift.
+bool dataflow_step(ParticleTree& ptree, const int step, const real visc, const double dt_max,
+                   const bool kick, const double dt, const double dt_next) {
+  TRACE_SCOPE("dataflow");
+  std::vector<int> stages;
+  stages.push_back(STAGE_DENS);
+#if SPH_DENSITY_FILTER
+  const DensFilterKernel filter_kernel = density_filter(step, dt, dt_max);
+  if (shepard_step(step) || SPH_DELTA_SPH) {
+    stages.push_back(STAGE_FILTER);
+    stages.push_back(STAGE_APPLY_FILTER);
+  }
 #endif
+  stages.push_back(STAGE_HYDRO);
+  if (kick) stages.push_back(STAGE_KICK_DRIFT);
 
-#if SPH_2D
-  const char* datafile = "data/data2d.txt";
-#else
-  const char* datafile = "data/data3d.txt";
+  const calc_kernel_t dens_kernel  = get_calc_kernel(CALC_TYPE_DENS);
+  const HydroKernel   hydro_kernel = {visc};
+  std::vector<char> leaf_reuse(ptree.n_leafs(), true);
+  ptree.calc_dataflow(stages.size(), [&] (ParticleTreeNode* leaf, int stage) {
+    switch (stages[stage]) {
+      case STAGE_DENS:
+        ptree.calc_leaf(leaf->index, dens_kernel);
+        break;
+#if SPH_DENSITY_FILTER
+      case STAGE_FILTER:
+        ptree.calc_leaf(leaf->index, filter_kernel, true);
+        break;
+      case STAGE_APPLY_FILTER:
+        for (int i = 0; i < leaf->n_fluid; i++) {
+          apply_density_filter(leaf->particles_i[i]);
+        }
+        break;
+#endif
+      case STAGE_HYDRO:
+        ptree.calc_leaf(leaf->index, hydro_kernel, true);
+        break;
+#if SPH_FUSED_INTEGRATOR
+      case STAGE_KICK_DRIFT:
+        for (int i = 0; i < leaf->n_fluid; i++) {
+          if (!kick_drift(leaf->particles_i[i], dt, dt_next)) leaf_reuse[leaf->index] = false;
+        }
+        break;
+#endif
+    }
+  });
+  for (char r : leaf_reuse) {
+    if (!r) return false;
+  }
+  return true;
+}
 #endif
 
-  std::vector<Particle> particles;
-  setup_particles(particles, datafile);
-  ParticleTree ptree(particles);
+typedef struct {
+  int      id;        // in the ensemble, -1 for a single run
+  real     alpha;     // artificial viscosity
+  DamBreak scenario;
+  char     dir[64];   // prefix of the output files
+} RunParams;
+
+// Simulate until END_TIME or SPH_MAX_STEP and return the time reached.
+// Runs share nothing but the (read-only) initial particles and wall tree, so
+// several of them can be in flight at once.
+double run(const RunParams& params, const std::vector<Particle>& particles,
+           std::shared_ptr<const WallTree> walls) {
+  const real   visc   = artificial_visc(params.alpha);
+  const double dt_max = max_time_step(params.alpha);
+  ParticleTree ptree(particles, walls);
 
 #if SPH_REUSE_TREE
   bool reuse = false;
   int reuse_count = 0;
 #endif
 
+#if SPH_TREE_STATS
+  char stats_file[256];
+  sprintf(stats_file, "%stree_stats%dd.txt", params.dir, DIM);
+  TreeStatsWriter stats_writer(stats_file);
+  TreeStats stats;
+#endif
+
+#if SPH_ANALYSIS_INTERVAL
+  char analysis_file[256];
+  sprintf(analysis_file, "%sanalysis%dd.txt", params.dir, DIM);
+  AnalysisWriter analysis(analysis_file);
+  const BoundingBox box = obstacle(params.scenario);
+#endif
+
+#if SPH_RENDER_INTERVAL
+  FrameRenderer renderer(SPH_RENDER_WIDTH);
+#endif
+
+#if SPH_METRICS_PORT
+  RunMetrics metrics(params.id);
+  long pairs = 0;
+#endif
+#if SPH_LOG_INTERVAL
+  uint64_t last_log = 0;
+#endif
+
+#if !SPH_DATAFLOW
   calc_kernel_t dens_kernel  = get_calc_kernel(CALC_TYPE_DENS);
-  calc_kernel_t hydro_kernel = get_calc_kernel(CALC_TYPE_HYDRO);
+  HydroKernel   hydro_kernel = {visc};
+#endif
 
   // Main loop for time integration
   double dt = 0;
   int step = 0;
   uint64_t t_all = 0;
   uint64_t calc_t_all = 0;
-  for (double time = 0; time < END_TIME && step < SPH_MAX_STEP; time += dt, step++) {
+#if SPH_BLOCK_DT
+  // inactive particles are drifted every tick, so that their neighbors see
+  // extrapolated positions, but are neither kicked nor recomputed
+  int tick = 0;
+  int n_active = 0;
+#endif
+  // set when the previous step already kicked and drifted the particles
+  bool advanced = false;
+#if SPH_FUSED_INTEGRATOR && SPH_REUSE_TREE
+  bool next_reuse = false;
+#endif
+  double time = 0;
+  for (; time < END_TIME && step < SPH_MAX_STEP; time += dt, step++) {
     uint64_t t1 = gettime_in_nsec();
 
-    if (step > 0) {
+#if SPH_FUSED_INTEGRATOR && SPH_REUSE_TREE
+    if (advanced) reuse = next_reuse;
+#endif
+    if (step > 0 && !advanced) {
       // Leap frog: Initial Kick & Full Drift
+#if SPH_BLOCK_DT
+      initial_kick(ptree, dt_max);
+#else
       initial_kick(ptree, dt);
+#endif
 #if SPH_REUSE_TREE
       reuse = full_drift(ptree, dt);
 #else
       full_drift(ptree, dt);
 #endif
     }
+#if SPH_METRICS_PORT
+    uint64_t d_t = gettime_in_nsec();
+#if SPH_REUSE_TREE
+    const bool rebuilt = !reuse;
+#else
+    const bool rebuilt = true;
+#endif
+#endif
 
 #if SPH_REUSE_TREE
     if (!reuse) {
       set_prev_pos(ptree);
-      ptree.build();
+      update_tree(ptree, reuse_count);
       reuse_count++;
     }
 #else
-    ptree.build();
+    update_tree(ptree, step);
+#endif
+#if SPH_METRICS_PORT
+    if (rebuilt) {
+      // density over all particles, forces over the fluid ones
+      pairs = ptree.candidate_pairs(false) + ptree.candidate_pairs(true);
+      metrics.set_memory(ptree.particle_bytes(), ptree.gather_bytes());
+    }
+#endif
+
+#if SPH_REORDER_INTERVAL
+    // leaves drift away from the memory order of the last build
+    if (step % SPH_REORDER_INTERVAL == 0) ptree.reorder();
+#endif
+
+#if SPH_BLOCK_DT
+    set_active(ptree, tick);
 #endif
 
     uint64_t c_t1 = gettime_in_nsec();
     // particle interactions
-    ptree.calc(dens_kernel);
-    ptree.calc(hydro_kernel);
+#if SPH_DATAFLOW_KICK && SPH_REUSE_TREE
+    next_reuse = dataflow_step(ptree, step, visc, dt_max, !output_step(step), dt, get_time_step(ptree, dt_max));
+#elif SPH_DATAFLOW_KICK
+    dataflow_step(ptree, step, visc, dt_max, !output_step(step), dt, get_time_step(ptree, dt_max));
+#elif SPH_DATAFLOW
+    dataflow_step(ptree, step, visc, dt_max, false, dt, 0);
+#else
+    {
+      TRACE_SCOPE("dens");
+      ptree.calc(dens_kernel);
+    }
+#if SPH_DENSITY_FILTER
+    if (shepard_step(step)) {
+      TRACE_SCOPE("shepard");
+      ptree.calc(density_filter(step, dt, dt_max), true);
+      apply_density_filter(ptree);
+    } else if (SPH_DELTA_SPH) {
+      TRACE_SCOPE("diffusion");
+      ptree.calc(density_filter(step, dt, dt_max), true);
+      apply_density_filter(ptree);
+    }
+#endif
+    {
+      TRACE_SCOPE("hydro");
+      ptree.calc(hydro_kernel, true);
+    }
+#endif
     uint64_t c_t2 = gettime_in_nsec();
     calc_t_all += c_t2 - c_t1;
 
+#if SPH_TREE_STATS
+    // the tree and the positions the interactions were computed with
+    stats = tree_stats(ptree);
+    stats_writer.write(time, step, stats);
+#endif
+
+#if SPH_BLOCK_DT
     if (step > 0) {
       // Leap frog: Final Kick
-      final_kick(ptree, dt);
+      final_kick(ptree, dt_max);
     }
 
     // Get a new timestep
-    dt = get_time_step(ptree);
+    const int n_ticks = assign_rungs(ptree, tick, dt_max, n_active);
+    tick = (tick + n_ticks) % N_TICKS;
+    dt = n_ticks * dt_max / N_TICKS;
+#else
+    // Get a new timestep (it only depends on the forces)
+    const double dt_next = get_time_step(ptree, dt_max);
+
+#if SPH_FUSED_INTEGRATOR
+    advanced = !output_step(step);
+    if (advanced) {
+      // Leap frog: Final Kick, then Initial Kick & Full Drift of the next step
+#if SPH_DATAFLOW_KICK
+      // already done by the dataflow graph
+#elif SPH_REUSE_TREE
+      next_reuse = kick_drift(ptree, dt, dt_next);
+#else
+      kick_drift(ptree, dt, dt_next);
+#endif
+    } else if (step > 0) {
+      final_kick(ptree, dt);
+    }
+#else
+    if (step > 0) {
+      // Leap frog: Final Kick
+      final_kick(ptree, dt);
+    }
+#endif
+    dt = dt_next;
+#endif
 
     uint64_t t2 = gettime_in_nsec();
     t_all += t2 - t1;
 
+#if SPH_ANALYSIS_INTERVAL
+    if (step % SPH_ANALYSIS_INTERVAL == 0) {
+      analysis.write(time, step, analyze(ptree, box));
+    }
+#endif
+
+#if SPH_RENDER_INTERVAL
+    if (step % SPH_RENDER_INTERVAL == 0) {
+      char filename[256];
+      renderer.render(ptree);
+      sprintf(filename, "%sframe%dd_%05d.%s", params.dir, DIM, step / SPH_RENDER_INTERVAL,
+              FrameRenderer::extension());
+      renderer.write(filename);
+    }
+#endif
+
     // Output result files
 #if SPH_OUTPUT_INTERVAL
     if (step % SPH_OUTPUT_INTERVAL == 0) {
       char filename[256];
-      sprintf(filename, "result/dambreaking%dd.txt.%d", DIM, step / SPH_OUTPUT_INTERVAL);
+#if SPH_OUTPUT_BINARY
+      sprintf(filename, "%sdambreaking%dd.snap.%d", params.dir, DIM, step / SPH_OUTPUT_INTERVAL);
+      write_snapshot(ptree, filename);
+#else
+      sprintf(filename, "%sdambreaking%dd.txt.%d", params.dir, DIM, step / SPH_OUTPUT_INTERVAL);
       output_particles(ptree, filename);
+#endif
 
-      std::cout << "================================" << std::endl;
-      std::cout << "output " << filename << "." << std::endl;
-      std::cout << "================================" << std::endl;
+      std::ostringstream banner;
+      banner << "================================" << std::endl;
+      banner << "output " << filename << "." << std::endl;
+      banner << "================================" << std::endl;
+      std::cout << banner.str();
 
       {
-        sprintf(filename, "result/particle_tree%dd.txt.%d", DIM, step / SPH_OUTPUT_INTERVAL);
+        sprintf(filename, "%sparticle_tree%dd.txt.%d", params.dir, DIM, step / SPH_OUTPUT_INTERVAL);
         std::ofstream fout(filename);
         fout << ptree;
         fout.close();
       }
-#ifdef RECORD_TIMELINE
-      {
-        sprintf(filename, "result/timeline.txt.%d", step / SPH_OUTPUT_INTERVAL);
-        std::ofstream fout(filename);
-        hydr_tree.dumpTimeline(fout);
-        fout.close();
+#if SPH_TREE_STATS
+      sprintf(filename, "%stree_stats%dd.txt.%d", params.dir, DIM, step / SPH_OUTPUT_INTERVAL);
+      write_tree_stats(stats, step, filename);
+#endif
+#if SPH_TRACE
+      // events since the previous output (the runs of an ensemble record
+      // concurrently, so their events are dumped once at the end)
+      if (params.id < 0) {
+        sprintf(filename, "result/trace.json.%d", step / SPH_OUTPUT_INTERVAL);
+        trace_dump(filename);
       }
 #endif
     }
+#endif
+#if SPH_METRICS_PORT || SPH_LOG_INTERVAL
+    uint64_t o_t = gettime_in_nsec();
+#endif
+
+#if SPH_METRICS_PORT
+    const uint64_t phase_ns[N_PHASES] = {d_t - t1, c_t1 - d_t, c_t2 - c_t1, t2 - c_t2, o_t - t2};
+    metrics.end_step(step, time, dt, rebuilt, pairs, phase_ns);
+#endif
+
+#if SPH_LOG_INTERVAL
+    // long runs print a line every SPH_LOG_INTERVAL ms, and on output steps
+    if (step > 0 && !output_step(step) && o_t - last_log < SPH_LOG_INTERVAL * 1000000ull) continue;
+    last_log = o_t;
 #endif
     // Output information to STDOUT
-    std::cout << "time: "    << std::fixed   << std::setprecision(5) << time                           << " [s] "
+    std::ostringstream line;
+    if (params.id >= 0) line << "run: " << params.id << " ";
+    line      << "time: "    << std::fixed   << std::setprecision(5) << time                           << " [s] "
               << "step: "    << std::setw(5) << std::right           << step                           << " "
               << "elapsed: " << std::setw(7) << std::right           << (double)(t2 - t1) / 1000000000 << " [s] "
 #if SPH_REUSE_TREE
-              << "reuse: "   << (reuse ? "true" : "false")
+              << "reuse: "   << (reuse ? "true" : "false") << " "
+#endif
+#if SPH_BLOCK_DT
+              << "active: "  << std::setw(7) << std::right           << n_active
 #endif
               << std::endl;
+    std::cout << line.str();
   }
 
-  std::cout << "total calc time = " << (double)calc_t_all / 1000000000 << " sec" << std::endl;
+  std::ostringstream out;
+  if (params.id >= 0) out << "run " << params.id << " (alpha " << params.alpha
+                          << ", box at " << params.scenario.box_offset_x << ")" << std::endl;
+  out << std::fixed << std::setprecision(5);
+  out << "total calc time = " << (double)calc_t_all / 1000000000 << " sec" << std::endl;
 #if SPH_REUSE_TREE
-  std::cout << "reuse = " << reuse_count << std::endl;
-  std::cout << "total time = " << (double)t_all / 1000000000 << " sec" << std::endl;
+  out << "reuse = " << reuse_count << std::endl;
+  out << "total time = " << (double)t_all / 1000000000 << " sec" << std::endl;
+#endif
+  out << "neighbors = " << ptree.mean_fluid_neighbors() << std::endl;
+  out << "time per step = " << (double)t_all / 1000000000 / step << " sec" << std::endl;
+  out << "particle memory = " << (double)ptree.particle_bytes() / (1 << 20) << " MiB" << std::endl;
+  out << "gather buffer = " << (double)ptree.gather_bytes() / (1 << 20) << " MiB"
+      << " (" << ptree.gather_batches() << " batches)" << std::endl;
+  out << "peak rss = " << (double)peak_rss_bytes() / (1 << 20) << " MiB" << std::endl;
+  std::cout << out.str();
+
+  return time;
+}
+
+/*
+ * Ensemble mode: sph.out <file> runs one simulation per line of the file,
+ *
+ *   alpha [box_offset_x]
+ *
+ * with the artificial viscosity and the obstacle position of scenario.hpp
+ * (in particles at scale 1); the k-th run writes to result/run<k>/.
+ * Everything else, including the resolution, is fixed at compile time; with
+ * SPH_BLOCK_DT the coarsest rung steps with the run's own maximum step. Runs
+ * with the same geometry start from the same generated particles and share
+ * the wall tree and the wall-wall neighbor lists.
+ *
+ * Up to SPH_ENSEMBLE_WIDTH runs (default: one per worker) are in flight at
+ * once, each taking the next run in order of decreasing estimated cost when
+ * it finishes (longest processing time first), while the idle workers steal
+ * from the parallel loops of the runs in flight. Small runs that do not scale
+ * on their own thereby fill the machine between them. This needs
+ * SPH_TASK_RUNTIME (or SPH_LOOP_PARALLEL, one thread per run); other builds
+ * do the runs one after another.
+ */
+double ensemble_cost(const RunParams& params, const size_t n_particles) {
+  const double steps = std::min<double>(SPH_MAX_STEP, std::ceil(END_TIME / max_time_step(params.alpha)));
+  return steps * n_particles;
+}
+
+int run_ensemble(const char* filename) {
+  std::ifstream ifs(filename);
+  if (!ifs) {
+    perror(filename);
+    return 1;
+  }
+  std::vector<RunParams> runs;
+  std::string l;
+  while (std::getline(ifs, l)) {
+    std::istringstream iss(l);
+    RunParams params;
+    params.id       = runs.size();
+    params.scenario = dam_break();
+    if (l.empty() || l[0] == '#' || !(iss >> params.alpha)) continue;
+    iss >> params.scenario.box_offset_x;
+    sprintf(params.dir, "result/run%d/", params.id);
+    mkdir(params.dir, 0755);
+    runs.push_back(params);
+  }
+
+  // one set of initial particles and one wall tree per geometry
+  std::map<int, std::vector<Particle>> initial;
+  std::map<int, std::shared_ptr<const WallTree>> walls;
+  for (const RunParams& params : runs) {
+    std::vector<Particle>& particles = initial[params.scenario.box_offset_x];
+    if (!particles.empty()) continue;
+    generate_dam_break(params.scenario, particles);
+    walls[params.scenario.box_offset_x] = ParticleTree(particles).walls();
+  }
+
+  std::vector<int> order(runs.size());
+  for (size_t k = 0; k < runs.size(); k++) order[k] = k;
+  std::stable_sort(order.begin(), order.end(), [&] (int a, int b) {
+    return ensemble_cost(runs[a], initial[runs[a].scenario.box_offset_x].size()) >
+           ensemble_cost(runs[b], initial[runs[b].scenario.box_offset_x].size());
+  });
+
+  std::vector<double> simulated(runs.size());
+  auto run_one = [&] (const int k) {
+    const RunParams& params = runs[order[k]];
+    simulated[order[k]] = run(params, initial[params.scenario.box_offset_x],
+                              walls[params.scenario.box_offset_x]);
+  };
+
+  const uint64_t t1 = gettime_in_nsec();
+#if SPH_LOOP_PARALLEL
+  // nested regions are serialized, so every run gets one thread
+#pragma omp parallel for schedule(dynamic, 1)
+  for (int k = 0; k < (int)runs.size(); k++) {
+    run_one(k);
+  }
+#elif SPH_TASK_RUNTIME
+  // the slots are root tasks, so a thread waiting inside one run never
+  // starts another
+  const int n_workers = TaskScheduler::instance().n_workers();
+  const int width = SPH_ENSEMBLE_WIDTH ? SPH_ENSEMBLE_WIDTH : n_workers;
+  std::atomic<int> next(0);
+  TaskGroup tg;
+  for (int w = 0; w < width; w++) {
+    tg.run_root([&] {
+      for (int k = next++; k < (int)runs.size(); k = next++) {
+        run_one(k);
+      }
+    });
+  }
+  tg.wait();
+#else
+  // mtbb may run a stolen slot below a wait of another run, which would then
+  // block until the whole slot is done; runs go one after another instead
+  for (int k = 0; k < (int)runs.size(); k++) {
+    run_one(k);
+  }
+#endif
+  const double elapsed = (double)(gettime_in_nsec() - t1) / 1000000000;
+
+  double total = 0;
+  for (double t : simulated) total += t;
+  std::cout << "runs = " << runs.size() << std::endl;
+  std::cout << "ensemble time = " << elapsed << " sec" << std::endl;
+  std::cout << "throughput = " << total / elapsed * 3600 << " simulated sec per hour" << std::endl;
+
+#if SPH_TRACE
+  trace_dump("result/trace.json");
+#endif
+  return 0;
+}
+
+int main(int argc, char* argv[]) {
+#if PARTICLE_SIMULATOR_TASK_PARALLEL
+#if DISABLE_STEAL
+  myth_adws_set_stealable(0);
+#endif
+#endif
+
+#if SPH_PIN_THREADS
+  pin_threads();
+#endif
+
+  if (argc > 1) return run_ensemble(argv[1]);
+
+  std::vector<Particle> particles;
+#if SPH_SCENARIO
+  generate_dam_break(dam_break(), particles);
+#if SPH_SCENARIO_EXPORT
+  char datafile[256];
+  sprintf(datafile, "result/data%dd.txt", DIM);
+  export_particles(particles, datafile);
+#endif
+#else
+#if SPH_2D
+  const char* datafile = "data/data2d.txt";
+#else
+  const char* datafile = "data/data3d.txt";
+#endif
+  setup_particles(particles, datafile);
+#endif
+
+  RunParams params;
+  params.id       = -1;
+  params.alpha    = ALPHA;
+  params.scenario = dam_break();
+  sprintf(params.dir, "result/");
+  run(params, particles, NULL);
+
+#if SPH_TRACE && !SPH_OUTPUT_INTERVAL
+  trace_dump("result/trace.json");
 #endif
 
   return 0;
@@ -0,0 +1,222 @@
+#include <cstdlib>
+#include <sched.h>
+
+#include "config.hpp"
+
+#if SPH_TASK_RUNTIME
+
+#include "task.hpp"
+#include "numa.hpp"
+
+static thread_local int tls_worker_id = -1;
+// number of tasks running on the stack of this thread
+static thread_local int tls_depth = 0;
+
+static inline void run_task(Task* t) {
+  tls_depth++;
+  t->run();
+  tls_depth--;
+}
+
+TaskDeque::TaskDeque(const int64_t capacity) : top_(0), bottom_(0) {
+  arrays_.emplace_back(new Array(capacity));
+  array_.store(arrays_.back().get(), std::memory_order_relaxed);
+}
+
+TaskDeque::Array* TaskDeque::grow(Array* a, const int64_t top, const int64_t bottom) {
+  Array* b = new Array(2 * (a->mask + 1));
+  for (int64_t i = top; i < bottom; i++) {
+    b->put(i, a->get(i));
+  }
+  arrays_.emplace_back(b);
+  array_.store(b, std::memory_order_release);
+  return b;
+}
+
+void TaskDeque::push(Task* t) {
+  const int64_t b   = bottom_.load(std::memory_order_relaxed);
+  const int64_t top = top_.load(std::memory_order_acquire);
+  Array* a = array_.load(std::memory_order_relaxed);
+  if (b - top > a->mask) a = grow(a, top, b);
+  a->put(b, t);
+  std::atomic_thread_fence(std::memory_order_release);
+  bottom_.store(b + 1, std::memory_order_relaxed);
+}
+
+Task* TaskDeque::pop() {
+  const int64_t b = bottom_.load(std::memory_order_relaxed) - 1;
+  Array* a = array_.load(std::memory_order_relaxed);
+  bottom_.store(b, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  int64_t top = top_.load(std::memory_order_relaxed);
+  Task* t = NULL;
+  if (top <= b) {
+    t = a->get(b);
+    if (top == b) {
+      // last task: race against thieves
+      if (!top_.compare_exchange_strong(top, top + 1, std::memory_order_seq_cst,
+                                        std::memory_order_relaxed)) {
+        t = NULL;
+      }
+      bottom_.store(b + 1, std::memory_order_relaxed);
+    }
+  } else {
+    bottom_.store(b + 1, std::memory_order_relaxed);
+  }
+  return t;
+}
+
+Task* TaskDeque::steal() {
+  int64_t top = top_.load(std::memory_order_acquire);
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  const int64_t b = bottom_.load(std::memory_order_acquire);
+  if (top >= b) return NULL;
+  Array* a = array_.load(std::memory_order_acquire);
+  Task* t = a->get(top);
+  if (!top_.compare_exchange_strong(top, top + 1, std::memory_order_seq_cst,
+                                    std::memory_order_relaxed)) {
+    return NULL;
+  }
+  return t;
+}
+
+inline int default_n_workers() {
+  if (const char* env = getenv("SPH_NUM_THREADS")) {
+    const int n = atoi(env);
+    if (n > 0) return n;
+  }
+  cpu_set_t mask;
+  if (sched_getaffinity(0, sizeof(mask), &mask) == 0) {
+    return CPU_COUNT(&mask);
+  }
+  const int n = std::thread::hardware_concurrency();
+  return n > 0 ? n : 1;
+}
+
+TaskScheduler::TaskScheduler()
+  : n_workers_(default_n_workers()), deques_(new TaskDeque[n_workers_]),
+    stop_(false), n_sleeping_(0), epoch_(0), n_roots_(0) {
+  tls_worker_id = 0;
+#if SPH_PIN_THREADS
+  pin_to_cpu(0);
+#endif
+  for (int id = 1; id < n_workers_; id++) {
+    threads_.emplace_back([this, id] { worker_loop(id); });
+  }
+}
+
+TaskScheduler::~TaskScheduler() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stop_.store(true);
+    epoch_++;
+  }
+  cv_.notify_all();
+  for (auto& t : threads_) t.join();
+}
+
+TaskScheduler& TaskScheduler::instance() {
+  static TaskScheduler scheduler;
+  return scheduler;
+}
+
+int TaskScheduler::worker_id() {
+  return tls_worker_id;
+}
+
+Task* TaskScheduler::take_root() {
+  if (n_roots_.load(std::memory_order_relaxed) == 0) return NULL;
+  std::lock_guard<std::mutex> lock(roots_mutex_);
+  if (roots_.empty()) return NULL;
+  Task* t = roots_.front();
+  roots_.pop_front();
+  n_roots_.fetch_sub(1, std::memory_order_relaxed);
+  return t;
+}
+
+// own deque first, then a few random victims, then (outside of any task)
+// the root tasks
+Task* TaskScheduler::find_task(const int id, uint64_t& rng) {
+  if (Task* t = deques_[id].pop()) return t;
+  for (int k = 0; k < 2 * n_workers_; k++) {
+    rng ^= rng << 13;
+    rng ^= rng >> 7;
+    rng ^= rng << 17;
+    const int victim = rng % n_workers_;
+    if (victim == id) continue;
+    if (Task* t = deques_[victim].steal()) return t;
+  }
+  return tls_depth == 0 ? take_root() : NULL;
+}
+
+void TaskScheduler::worker_loop(const int id) {
+  tls_worker_id = id;
+#if SPH_PIN_THREADS
+  pin_to_cpu(id);
+#endif
+  uint64_t rng = 0x9e3779b97f4a7c15ULL * (id + 1);
+  constexpr int SPIN_ROUNDS = 1024;
+  int idle = 0;
+  while (!stop_.load(std::memory_order_relaxed)) {
+    if (Task* t = find_task(id, rng)) {
+      run_task(t);
+      idle = 0;
+      continue;
+    }
+    if (++idle < SPIN_ROUNDS) {
+      std::this_thread::yield();
+      continue;
+    }
+    // Announce sleeping before the last look, so that a spawn either sees a
+    // sleeper and bumps the epoch, or its task is found here.
+    n_sleeping_.fetch_add(1, std::memory_order_seq_cst);
+    const uint64_t epoch = epoch_.load(std::memory_order_seq_cst);
+    Task* t = find_task(id, rng);
+    if (!t) {
+      std::unique_lock<std::mutex> lock(mutex_);
+      cv_.wait(lock, [&] { return epoch_.load() != epoch; });
+    }
+    n_sleeping_.fetch_sub(1, std::memory_order_relaxed);
+    if (t) run_task(t);
+    idle = 0;
+  }
+}
+
+void TaskScheduler::wake() {
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  if (n_sleeping_.load(std::memory_order_relaxed) > 0) {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      epoch_++;
+    }
+    cv_.notify_all();
+  }
+}
+
+void TaskScheduler::spawn(Task* t) {
+  deques_[tls_worker_id].push(t);
+  wake();
+}
+
+void TaskScheduler::spawn_root(Task* t) {
+  {
+    std::lock_guard<std::mutex> lock(roots_mutex_);
+    roots_.push_back(t);
+    n_roots_.fetch_add(1, std::memory_order_relaxed);
+  }
+  wake();
+}
+
+void TaskScheduler::wait(const std::atomic<int>& pending) {
+  const int id = tls_worker_id;
+  uint64_t rng = 0x9e3779b97f4a7c15ULL * (id + 1) + 1;
+  while (pending.load(std::memory_order_acquire) > 0) {
+    if (Task* t = find_task(id, rng)) {
+      run_task(t);
+    } else {
+      std::this_thread::yield();
+    }
+  }
+}
+
+#endif
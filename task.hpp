@@ -0,0 +1,193 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "config.hpp"
+
+/*
+ * Work-stealing task runtime (SPH_TASK_RUNTIME).
+ *
+ * One worker per CPU of the process affinity mask (SPH_NUM_THREADS in the
+ * environment overrides), the thread that first uses the runtime being
+ * worker 0. Every worker owns a Chase-Lev deque: it pushes and pops its own
+ * tasks at the bottom while idle workers steal from the top of a random
+ * victim. A thread waiting for a TaskGroup keeps running tasks until the
+ * group is done, so fork-join can be nested to any depth.
+ *
+ * Root tasks (TaskGroup::run_root) go to a shared FIFO instead and are only
+ * taken by threads not inside another task: idle workers and a top-level
+ * waiter. A long task, such as a whole run of the ensemble, thus never ends
+ * up nested below a wait in another one.
+ */
+
+class Task {
+  public:
+    virtual ~Task() {}
+    virtual void run() = 0;
+};
+
+// Chase-Lev deque (with the memory orderings of Le et al., PPoPP 2013).
+// Only the owner calls push and pop; anyone may steal. Arrays replaced by a
+// grow are kept until the deque is destroyed, since a thief may still read
+// from them.
+class TaskDeque {
+  private:
+    struct Array {
+      int64_t                            mask;
+      std::unique_ptr<std::atomic<Task*>[]> slots;
+
+      Array(const int64_t capacity)
+        : mask(capacity - 1), slots(new std::atomic<Task*>[capacity]) {}
+
+      Task* get(const int64_t i) const {
+        return slots[i & mask].load(std::memory_order_relaxed);
+      }
+      void put(const int64_t i, Task* t) {
+        slots[i & mask].store(t, std::memory_order_relaxed);
+      }
+    };
+
+    // top_ is written by thieves, bottom_ only by the owner
+    std::atomic<int64_t>             top_;
+    char                             pad_[64 - sizeof(std::atomic<int64_t>)];
+    std::atomic<int64_t>             bottom_;
+    std::atomic<Array*>              array_;
+    std::vector<std::unique_ptr<Array>> arrays_;
+
+    Array* grow(Array* a, const int64_t top, const int64_t bottom);
+
+  public:
+    TaskDeque(const int64_t capacity = 256);
+    TaskDeque(const TaskDeque&) = delete;
+    TaskDeque& operator = (const TaskDeque&) = delete;
+
+    void  push(Task* t);
+    Task* pop();
+    Task* steal();
+};
+
+class TaskScheduler {
+  private:
+    int                          n_workers_;
+    std::unique_ptr<TaskDeque[]> deques_;
+    std::vector<std::thread>     threads_;
+    std::atomic<bool>            stop_;
+    // idle workers sleep on cv_ until a spawn bumps epoch_
+    std::atomic<int>             n_sleeping_;
+    std::atomic<uint64_t>        epoch_;
+    std::mutex                   mutex_;
+    std::condition_variable      cv_;
+    // root tasks, see above
+    std::mutex                   roots_mutex_;
+    std::deque<Task*>            roots_;
+    std::atomic<int>             n_roots_;
+
+    TaskScheduler();
+    ~TaskScheduler();
+
+    void  worker_loop(const int id);
+    Task* find_task(const int id, uint64_t& rng);
+    Task* take_root();
+    void  wake();
+
+  public:
+    static TaskScheduler& instance();
+
+    // id of the calling worker, -1 on threads not owned by the runtime
+    static int worker_id();
+
+    int n_workers() const {
+      return n_workers_;
+    }
+
+    void spawn(Task* t);
+    void spawn_root(Task* t);
+    // run tasks until pending drops to zero
+    void wait(const std::atomic<int>& pending);
+};
+
+template <typename Func>
+class FuncTask : public Task {
+  private:
+    Func              body_;
+    std::atomic<int>* pending_;
+
+  public:
+    FuncTask(const Func& body, std::atomic<int>* pending)
+      : body_(body), pending_(pending) {}
+
+    void run() {
+      body_();
+      pending_->fetch_sub(1, std::memory_order_release);
+      delete this;
+    }
+};
+
+// Fork-join over tasks run(f); wait() returns when all of them have finished.
+// Outside of the workers run() executes f immediately.
+class TaskGroup {
+  private:
+    std::atomic<int> pending_;
+
+  public:
+    TaskGroup() : pending_(0) {}
+    TaskGroup(const TaskGroup&) = delete;
+    TaskGroup& operator = (const TaskGroup&) = delete;
+    ~TaskGroup() {
+      wait();
+    }
+
+    template <typename Func>
+    void run(const Func& f) {
+      // the first thread to get the scheduler becomes worker 0
+      TaskScheduler& scheduler = TaskScheduler::instance();
+      if (TaskScheduler::worker_id() < 0) {
+        f();
+        return;
+      }
+      pending_.fetch_add(1, std::memory_order_relaxed);
+      scheduler.spawn(new FuncTask<Func>(f, &pending_));
+    }
+
+    // as run(), but f is a root task: it is started only by a thread that is
+    // not running another task, never stolen by a waiter
+    template <typename Func>
+    void run_root(const Func& f) {
+      TaskScheduler& scheduler = TaskScheduler::instance();
+      if (TaskScheduler::worker_id() < 0) {
+        f();
+        return;
+      }
+      pending_.fetch_add(1, std::memory_order_relaxed);
+      scheduler.spawn_root(new FuncTask<Func>(f, &pending_));
+    }
+
+    void wait() {
+      if (pending_.load(std::memory_order_acquire) > 0) {
+        TaskScheduler::instance().wait(pending_);
+      }
+    }
+};
+
+// recursive bisection of [begin, end) down to grain iterations
+template <typename Func>
+void task_parallel_for(const int begin, const int end, const int grain, const Func& body) {
+  if (end - begin <= grain) {
+    for (int i = begin; i < end; i++) {
+      body(i);
+    }
+    return;
+  }
+  const int mid = begin + (end - begin) / 2;
+  TaskGroup tg;
+  tg.run([&] { task_parallel_for(mid, end, grain, body); });
+  task_parallel_for(begin, mid, grain, body);
+  tg.wait();
+}
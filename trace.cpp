@@ -0,0 +1,59 @@
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "trace.hpp"
+
+#if SPH_TRACE
+
+static std::mutex                                trace_mutex;
+static std::vector<std::unique_ptr<TraceBuffer>> trace_buffers;
+static const uint64_t                            trace_origin = gettime_in_nsec();
+
+TraceBuffer::TraceBuffer(const int tid)
+  : events_(new TraceEvent[SPH_TRACE_EVENTS]), head_(0), tail_(0), tid_(tid) {}
+
+TraceBuffer::~TraceBuffer() {
+  delete[] events_;
+}
+
+// buffers outlive their threads, so that events of finished threads can
+// still be dumped
+TraceBuffer& trace_buffer() {
+  static thread_local TraceBuffer* buf = NULL;
+  if (!buf) {
+    std::lock_guard<std::mutex> lock(trace_mutex);
+    trace_buffers.emplace_back(new TraceBuffer(trace_buffers.size()));
+    buf = trace_buffers.back().get();
+  }
+  return *buf;
+}
+
+void trace_dump(const char* filename) {
+  FILE* fp = fopen(filename, "w");
+  if (!fp) {
+    perror(filename);
+    return;
+  }
+  std::lock_guard<std::mutex> lock(trace_mutex);
+  fprintf(fp, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+  bool first = true;
+  for (auto& buf : trace_buffers) {
+    fprintf(fp, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":0,\"tid\":%d,"
+                "\"args\":{\"name\":\"thread %d\"}}",
+            first ? "" : ",\n", buf->tid(), buf->tid());
+    first = false;
+    buf->drain([&] (const TraceEvent& e) {
+      fprintf(fp, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":0,\"tid\":%d,"
+                  "\"ts\":%.3f,\"dur\":%.3f",
+              e.name, buf->tid(), (e.begin - trace_origin) * 1e-3, (e.end - e.begin) * 1e-3);
+      if (e.arg >= 0) fprintf(fp, ",\"args\":{\"leaf\":%d}", e.arg);
+      fprintf(fp, "}");
+    });
+  }
+  fprintf(fp, "\n]}\n");
+  fclose(fp);
+}
+
+#endif
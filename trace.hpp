@@ -0,0 +1,88 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+
+#include "config.hpp"
+#include "util.hpp"
+
+/*
+ * Event tracer (SPH_TRACE), exported in the Chrome trace format
+ * (chrome://tracing, ui.perfetto.dev).
+ *
+ * Every thread records into its own ring buffer of SPH_TRACE_EVENTS events,
+ * so recording takes no locks; when a buffer is full the oldest events are
+ * overwritten. trace_dump() must be called while no other thread records,
+ * i.e. outside of parallel loops.
+ */
+
+typedef struct {
+  const char* name;  // string literal
+  uint64_t    begin; // ns
+  uint64_t    end;
+  int         arg;   // leaf index, or -1
+} TraceEvent;
+
+class TraceBuffer {
+  private:
+    TraceEvent*           events_;
+    std::atomic<uint64_t> head_;  // number of events ever recorded
+    uint64_t              tail_;  // first event not yet dumped
+    int                   tid_;
+
+  public:
+    TraceBuffer(const int tid);
+    ~TraceBuffer();
+    TraceBuffer(const TraceBuffer&) = delete;
+    TraceBuffer& operator = (const TraceBuffer&) = delete;
+
+    void record(const char* name, const uint64_t begin, const uint64_t end, const int arg) {
+      const uint64_t h = head_.load(std::memory_order_relaxed);
+      events_[h % SPH_TRACE_EVENTS] = {name, begin, end, arg};
+      head_.store(h + 1, std::memory_order_release);
+    }
+
+    // call f(event) for the events recorded since the last drain
+    template <typename Func>
+    void drain(const Func f) {
+      const uint64_t h = head_.load(std::memory_order_acquire);
+      if (h - tail_ > SPH_TRACE_EVENTS) tail_ = h - SPH_TRACE_EVENTS;
+      for (; tail_ < h; tail_++) {
+        f(events_[tail_ % SPH_TRACE_EVENTS]);
+      }
+    }
+
+    int tid() const {
+      return tid_;
+    }
+};
+
+// buffer of the calling thread, created on first use
+TraceBuffer& trace_buffer();
+
+// write the events recorded since the last dump and forget them
+void trace_dump(const char* filename);
+
+class TraceScope {
+  private:
+    const char* name_;
+    int         arg_;
+    uint64_t    begin_;
+
+  public:
+    TraceScope(const char* name, const int arg = -1)
+      : name_(name), arg_(arg), begin_(gettime_in_nsec()) {}
+    ~TraceScope() {
+      trace_buffer().record(name_, begin_, gettime_in_nsec(), arg_);
+    }
+};
+
+#define TRACE_CAT_(a, b) a##b
+#define TRACE_CAT(a, b)  TRACE_CAT_(a, b)
+
+#if SPH_TRACE
+// record the enclosing scope as one event
+# define TRACE_SCOPE(...) TraceScope TRACE_CAT(trace_scope_, __LINE__)(__VA_ARGS__)
+#else
+# define TRACE_SCOPE(...)
+#endif
@@ -0,0 +1,136 @@
+#include <cstring>
+#include <iomanip>
+
+#include "tree_stats.hpp"
+#include "trace.hpp"
+
+inline int log2_bin(const long v) {
+  int bin = 0;
+  for (long x = v; x > 0 && bin < TREE_STATS_BINS - 1; x >>= 1) bin++;
+  return bin;
+}
+
+inline int aspect_bin(const BoundingBox& bbox, double& aspect) {
+  const realvec d = bbox.max - bbox.min;
+#if SPH_2D
+  const real lo = min_(d.x, d.y);
+  const real hi = max_(d.x, d.y);
+#else
+  const real lo = min_(min_(d.x, d.y), d.z);
+  const real hi = max_(max_(d.x, d.y), d.z);
+#endif
+  if (lo <= 0) {
+    aspect = 0;
+    return TREE_STATS_BINS - 1;
+  }
+  aspect = hi / lo;
+  return min_(log2_bin((long)aspect), TREE_STATS_BINS - 2);
+}
+
+TreeStats tree_stats(const ParticleTree& ptree) {
+  TRACE_SCOPE("tree_stats");
+  constexpr real slen2 = SLEN * SLEN;
+  typedef struct {
+    TreeStats s;
+    int       n_aspect;
+    double    sum_aspect;
+  } Partial;
+  Partial init;
+  memset(&init, 0, sizeof(init));
+
+  Partial r = ptree.reduce_leaf(init, [&] (const ParticleTreeNode* leaf) {
+    Partial a = init;
+    a.s.n_leafs       = 1;
+    a.s.n_fluid_leafs = leaf->n_fluid > 0;
+    a.s.cand_dens     = (long)leaf->n_particles * leaf->n_neighbors;
+    a.s.cand_hydro    = (long)leaf->n_fluid * leaf->n_neighbors;
+    for (int i = 0; i < leaf->n_particles; i++) {
+      const realvec pos = leaf->particles_i[i].pos;
+      long n = 0;
+      ptree.for_neighbor(leaf, [&] (const ParticleTreeNode* nb) {
+        for (int j = 0; j < nb->n_particles; j++) {
+          const realvec dr = pos - nb->particles_i[j].pos;
+          if (dr * dr < slen2) n++;
+        }
+      });
+      a.s.pairs_dens += n;
+      if (i < leaf->n_fluid) a.s.pairs_hydro += n;
+    }
+    a.s.leaf_size[log2_bin(leaf->n_particles)]++;
+    a.s.leaf_neighbors[log2_bin(leaf->n_neighbors)]++;
+    double aspect;
+    a.s.leaf_aspect[aspect_bin(leaf->inner_bbox, aspect)]++;
+    if (aspect > 0) {
+      a.n_aspect   = 1;
+      a.sum_aspect = aspect;
+    }
+    return a;
+  }, [] (const Partial& a, const Partial& b) {
+    Partial c = a;
+    c.s.n_leafs       += b.s.n_leafs;
+    c.s.n_fluid_leafs += b.s.n_fluid_leafs;
+    c.s.cand_dens     += b.s.cand_dens;
+    c.s.pairs_dens    += b.s.pairs_dens;
+    c.s.cand_hydro    += b.s.cand_hydro;
+    c.s.pairs_hydro   += b.s.pairs_hydro;
+    for (int k = 0; k < TREE_STATS_BINS; k++) {
+      c.s.leaf_size[k]      += b.s.leaf_size[k];
+      c.s.leaf_neighbors[k] += b.s.leaf_neighbors[k];
+      c.s.leaf_aspect[k]    += b.s.leaf_aspect[k];
+    }
+    c.n_aspect   += b.n_aspect;
+    c.sum_aspect += b.sum_aspect;
+    return c;
+  });
+
+  TreeStats stats = r.s;
+  stats.depth        = ptree.depth();
+  stats.gather_bytes = ptree.gather_bytes();
+  stats.mean_aspect  = r.n_aspect ? r.sum_aspect / r.n_aspect : 0;
+  return stats;
+}
+
+inline double ratio(const long a, const long b) {
+  return b ? (double)a / b : 0.0;
+}
+
+void write_tree_stats(const TreeStats& stats, const int step, const char* filename) {
+  std::ofstream ofs(filename);
+  ofs << "# step " << step << std::endl
+      << "# leafs " << stats.n_leafs << " fluid_leafs " << stats.n_fluid_leafs
+      << " depth " << stats.depth << std::endl
+      << "# dens candidates " << stats.cand_dens << " pairs " << stats.pairs_dens
+      << " efficiency " << ratio(stats.pairs_dens, stats.cand_dens) << std::endl
+      << "# hydro candidates " << stats.cand_hydro << " pairs " << stats.pairs_hydro
+      << " efficiency " << ratio(stats.pairs_hydro, stats.cand_hydro) << std::endl
+      << "# gather_bytes " << stats.gather_bytes
+      << " mean_aspect " << stats.mean_aspect << std::endl
+      << "# bin lo hi leaf_size leaf_neighbors leaf_aspect" << std::endl;
+  for (int k = 0; k < TREE_STATS_BINS; k++) {
+    const long lo = k ? 1L << (k - 1) : 0;
+    const long hi = k ? 1L << k : 1;
+    ofs << k << " " << lo << " " << hi << " "
+        << stats.leaf_size[k] << " "
+        << stats.leaf_neighbors[k] << " "
+        << stats.leaf_aspect[k] << std::endl;
+  }
+}
+
+TreeStatsWriter::TreeStatsWriter(const char* filename) : ofs_(filename) {
+  ofs_ << "# time step leafs depth cand_dens pairs_dens cand_hydro pairs_hydro"
+       << " efficiency gather_bytes mean_aspect" << std::endl;
+}
+
+void TreeStatsWriter::write(const double time, const int step, const TreeStats& stats) {
+  ofs_ << std::scientific << std::setprecision(8) << time << " "
+       << std::defaultfloat << step               << " "
+       << stats.n_leafs      << " "
+       << stats.depth        << " "
+       << stats.cand_dens    << " "
+       << stats.pairs_dens   << " "
+       << stats.cand_hydro   << " "
+       << stats.pairs_hydro  << " "
+       << ratio(stats.pairs_hydro, stats.cand_hydro) << " "
+       << stats.gather_bytes << " "
+       << stats.mean_aspect  << std::endl;
+}
@@ -0,0 +1,49 @@
+#pragma once
+
+#include <cstddef>
+#include <fstream>
+
+#include "config.hpp"
+#include "defs.hpp"
+#include "particle_tree.hpp"
+
+/*
+ * Tree quality and interaction efficiency (SPH_TREE_STATS).
+ *
+ * Candidate pairs are all pairs of a leaf particle and a particle of its
+ * neighbor leaves, i.e. the pairs the kernels loop over; actual pairs are
+ * those within SLEN. Histograms use power-of-two bins: bin 0 holds zero,
+ * bin k values in [2^(k-1), 2^k).
+ */
+
+constexpr int TREE_STATS_BINS = 16;
+
+typedef struct {
+  int    n_leafs;
+  int    n_fluid_leafs;
+  int    depth;          // of the fluid tree
+  long   cand_dens;      // all particles of every leaf
+  long   pairs_dens;
+  long   cand_hydro;     // fluid particles only
+  long   pairs_hydro;
+  size_t gather_bytes;   // gather buffer of calc(), 0 without one
+  double mean_aspect;    // longest over shortest side of the leaf bboxes
+  long   leaf_size[TREE_STATS_BINS];
+  long   leaf_neighbors[TREE_STATS_BINS];
+  long   leaf_aspect[TREE_STATS_BINS]; // bin of the aspect ratio (last: flat)
+} TreeStats;
+
+TreeStats tree_stats(const ParticleTree& ptree);
+
+// histograms of one step, next to the particle_tree dump
+void write_tree_stats(const TreeStats& stats, const int step, const char* filename);
+
+// one summary line per step
+class TreeStatsWriter {
+  private:
+    std::ofstream ofs_;
+
+  public:
+    TreeStatsWriter(const char* filename);
+    void write(const double time, const int step, const TreeStats& stats);
+};
@@ -1,25 +1,78 @@
 #pragma once
 
 #include <ctime>
+#include <memory>
+#include <sys/resource.h>
 
 #include "config.hpp"
 
+#if SPH_TASK_RUNTIME
+#include "task.hpp"
+#elif SPH_TASK_PARALLEL
+#include <myth/myth.h>
+#include <mtbb/parallel_for.h>
+#include <mtbb/task_group.h>
+typedef mtbb::task_group TaskGroup;
+#else
+// without a task backend tasks run as soon as they are created
+class TaskGroup {
+  public:
+    template <typename Func>
+    void run(const Func& f) {
+      f();
+    }
+    void wait() {}
+};
+#endif
+
 inline uint64_t gettime_in_nsec() {
   struct timespec ts;
   clock_gettime(CLOCK_MONOTONIC, &ts);
   return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
 }
 
+// peak resident set size of the process
+inline size_t peak_rss_bytes() {
+  struct rusage ru;
+  getrusage(RUSAGE_SELF, &ru);
+  return (size_t)ru.ru_maxrss * 1024;
+}
+
+template <typename T>
+SPH_KERNEL
+inline const T& max_(const T& a, const T& b) {
+  return (a > b) ? a : b;
+}
+
+template <typename T>
+SPH_KERNEL
+inline const T& min_(const T& a, const T& b) {
+  return (b < a) ? b : a;
+}
+
+// iterations per task of a parallel_for over n iterations on n_workers
+inline int pfor_grain(const int n, const int n_workers) {
+#if SPH_PFOR_GRAIN
+  return SPH_PFOR_GRAIN;
+#else
+  return max_(1, n / (8 * n_workers));
+#endif
+}
+
 template <typename Func>
 inline void parallel_for(int begin, int end, const Func body) {
-#ifdef SPH_TASK_PARALLEL
-  mtbb::parallel_for(begin, end, 1, CUTOFF_PFOR, [&] (int a, int b) {
+#if SPH_TASK_RUNTIME
+  const int grain = pfor_grain(end - begin, TaskScheduler::instance().n_workers());
+  task_parallel_for(begin, end, grain, body);
+#elif SPH_TASK_PARALLEL
+  const int grain = pfor_grain(end - begin, myth_get_num_workers());
+  mtbb::parallel_for(begin, end, 1, grain, [&] (int a, int b) {
     for (int i = a; i < b; i++) {
       body(i);
     }
   });
 #else
-#ifdef SPH_LOOP_PARALLEL
+#if SPH_LOOP_PARALLEL
 #pragma omp parallel for
 #endif
   for (int i = begin; i < end; i++) {
@@ -28,14 +81,65 @@ inline void parallel_for(int begin, int end, const Func body) {
 #endif
 }
 
-template <typename T>
-SPH_KERNEL
-inline const T& max_(const T& a, const T& b) {
-  return (a > b) ? a : b;
+// Deterministic reduction of body(i) over [begin, end). The range is cut into
+// chunks that depend only on its length, each chunk is reduced in order, and
+// the chunk results are combined pairwise in a fixed tree, so the result is
+// the same for any number of threads and any schedule. init must be an
+// identity of combine.
+template <typename T, typename Func, typename Combine>
+inline T parallel_reduce(int begin, int end, const T init, const Func body, const Combine combine) {
+  constexpr int CHUNK = SPH_REDUCE_CHUNK;
+  const int n_chunks = (end - begin + CHUNK - 1) / CHUNK;
+  if (n_chunks <= 0) return init;
+  std::unique_ptr<T[]> partials(new T[n_chunks]);
+  parallel_for(0, n_chunks, [&] (int c) {
+    const int a = begin + c * CHUNK;
+    const int b = (end - a < CHUNK) ? end : a + CHUNK;
+    T acc = init;
+    for (int i = a; i < b; i++) {
+      acc = combine(acc, body(i));
+    }
+    partials[c] = acc;
+  });
+  for (int stride = 1; stride < n_chunks; stride *= 2) {
+    for (int c = 0; c + stride < n_chunks; c += 2 * stride) {
+      partials[c] = combine(partials[c], partials[c + stride]);
+    }
+  }
+  return partials[0];
 }
 
-template <typename T>
-SPH_KERNEL
-inline const T& min_(const T& a, const T& b) {
-  return (b < a) ? b : a;
+struct max_op {
+  template <typename T>
+  T operator () (const T& a, const T& b) const {
+    return max_(a, b);
+  }
+};
+
+struct sum_op {
+  template <typename T>
+  T operator () (const T& a, const T& b) const {
+    return a + b;
+  }
+};
+
+struct and_op {
+  bool operator () (const bool a, const bool b) const {
+    return a && b;
+  }
+};
+
+template <typename T, typename Func>
+inline T parallel_max(int begin, int end, const T init, const Func body) {
+  return parallel_reduce(begin, end, init, body, max_op());
+}
+
+template <typename T, typename Func>
+inline T parallel_sum(int begin, int end, const Func body) {
+  return parallel_reduce(begin, end, T(0), body, sum_op());
+}
+
+template <typename Func>
+inline bool parallel_all(int begin, int end, const Func body) {
+  return parallel_reduce(begin, end, true, body, and_op());
 }